@@ -0,0 +1,319 @@
+/*
+* Copyright 2021 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#pragma once
+
+#include <Windows.h>
+#include "KeyboardHook.h"
+
+/*
+The key filter state machine of the keyboard hook, as a transition table generated at
+compile time. The table is indexed by current state, message class and key class, each
+entry holds the next state and the actions to be taken by the caller. This header has
+no dependencies on the hook itself and can be used by benchmarks and simulations.
+
+Message classes: WM_KEYDOWN, WM_KEYUP and everything else (WM_SYSKEYDOWN, WM_SYSKEYUP).
+Key classes are relative to a filter rule (see KeyFilterRule): The trigger key of the rule,
+follow-up keys of the rule (the keys a touch pad generates after the trigger) and genuine
+keys (all other keys). A rule without explicit follow-up keys treats every other key as
+follow-up key, that is the original LEFT-WINDOWS behavior.
+*/
+
+enum KeyMessageClass {
+	NoEdgeKeyDown = 0,
+	NoEdgeKeyUp = 1,
+	NoEdgeOtherMessage = 2
+};
+
+enum KeyClass {
+	NoEdgeFollowUpKey = 0,
+	NoEdgeTriggerKey = 1,
+	NoEdgeGenuineKey = 2
+};
+
+// Table entry layout: Next state in the low bits, actions in the high bits.
+#define NOEDGE_STATE_MASK	0x07
+#define NOEDGE_REPLAY		0x08	// Replay the buffered key press, followed by the event
+#define NOEDGE_SWALLOW		0x10	// Discard the event
+#define NOEDGE_ARM			0x20	// Buffer the key press and start the timer
+#define NOEDGE_CANCEL		0x40	// Stop the timer
+#define NOEDGE_SAMPLE		0x80	// Event is a gap sample for the adaptive timeout
+
+#define NOEDGE_STATES		4
+#define NOEDGE_MESSAGES		3
+#define NOEDGE_KEYCLASSES	3
+
+// Table index of state, message class and key class: Four entries per class, the table fills one cache line.
+#define NOEDGE_FILTER_INDEX(state, message, key) (((state) << 4) | ((message) << 2) | (key))
+
+/*
+The transition function, the same logic as the original hand-written switch:
+- Idle: A trigger key press will be buffered and discarded.
+- WinPressed: Any event stops the timer. A repeated trigger key press means the timer has
+elapsed and the key press has been replayed, so the sequence is a real hot-key. A genuine
+key means a real hot-key as well, the buffered key press will be replayed immediately.
+Anything else starts the sequence to be discarded up to and including the trigger key release.
+- IgnoreKeyEvents: Discard everything up to and including the trigger key release.
+- WaitWinRelease: Pass everything up to and including the trigger key release.
+*/
+constexpr BYTE NoEdgeTransition(int state, int message, int key) {
+	return state == NoEdgeIdle
+		? (message == NoEdgeKeyDown && key == NoEdgeTriggerKey ? NoEdgeWinPressed | NOEDGE_SWALLOW | NOEDGE_ARM : NoEdgeIdle)
+		: state == NoEdgeWinPressed
+		? (key == NoEdgeTriggerKey
+			? (message == NoEdgeKeyDown ? NoEdgeWaitWinRelease | NOEDGE_CANCEL
+				: message == NoEdgeKeyUp ? NoEdgeIdle | NOEDGE_CANCEL | NOEDGE_SWALLOW
+				: NoEdgeIgnoreKeyEvents | NOEDGE_CANCEL | NOEDGE_SWALLOW)
+			: key == NoEdgeGenuineKey ? NoEdgeWaitWinRelease | NOEDGE_CANCEL | NOEDGE_SWALLOW | NOEDGE_REPLAY
+			: NoEdgeIgnoreKeyEvents | NOEDGE_CANCEL | NOEDGE_SWALLOW | NOEDGE_SAMPLE)
+		: state == NoEdgeIgnoreKeyEvents
+		? (message == NoEdgeKeyUp && key == NoEdgeTriggerKey ? NoEdgeIdle | NOEDGE_SWALLOW : NoEdgeIgnoreKeyEvents | NOEDGE_SWALLOW)
+		: (message == NoEdgeKeyUp && key == NoEdgeTriggerKey ? NoEdgeIdle
+			: key == NoEdgeFollowUpKey ? NoEdgeWaitWinRelease | NOEDGE_SAMPLE : NoEdgeWaitWinRelease);
+}
+
+struct alignas(64) KeyFilterTable {
+	BYTE Entry[NOEDGE_STATES * 16];
+};
+
+constexpr KeyFilterTable MakeKeyFilterTable() {
+	KeyFilterTable table = {};
+	for (int state = 0; state < NOEDGE_STATES; state++)
+		for (int message = 0; message < NOEDGE_MESSAGES; message++)
+			for (int key = 0; key < NOEDGE_KEYCLASSES; key++)
+				table.Entry[NOEDGE_FILTER_INDEX(state, message, key)] = NoEdgeTransition(state, message, key);
+	return table;
+}
+
+static constexpr KeyFilterTable KeyFilter = MakeKeyFilterTable();
+
+static_assert((KeyFilter.Entry[NOEDGE_FILTER_INDEX(NoEdgeIdle, NoEdgeKeyDown, NoEdgeTriggerKey)] & NOEDGE_STATE_MASK) == NoEdgeWinPressed,
+	"Trigger key press must start the sequence");
+
+/*
+Filter rules. Each rule consists of a trigger key (virtual key code and scan code, scan code
+0 matches every scan code), the set of follow-up keys as a bitmap of virtual key codes and
+a timeout in milliseconds (0 for the default timeout). Rules are compiled into a rule set
+with a trigger bitmap and a per virtual key code rule index, to be looked up in O(1).
+Rule sets are immutable once passed to the hook. There is at most one rule per trigger key,
+KeyFilterAddRule merges rules with the same trigger key.
+*/
+#define NOEDGE_MAX_RULES 16
+
+struct alignas(64) KeyFilterRule {
+	DWORD FollowUp[8];				// Bitmap of follow-up virtual key codes
+	DWORD Timeout;					// Timeout in milliseconds, 0 for default
+	BYTE VkCode;					// Trigger virtual key code
+	BYTE ScanCode;					// Trigger scan code, 0 for any
+};
+
+struct alignas(64) KeyFilterRules {
+	DWORD Triggers[8];				// Bitmap of trigger virtual key codes
+	DWORD Count;					// Number of rules
+	DWORD Timeout;					// Default timeout in milliseconds, 0 for NoEdgeTimeout
+	BYTE RuleIndex[256];			// Rule of each trigger virtual key code
+	struct KeyFilterRule Rule[NOEDGE_MAX_RULES];
+};
+
+static_assert(sizeof(struct KeyFilterRule) == 64, "A rule must fill exactly one cache line");
+
+inline void KeyFilterInitRules(struct KeyFilterRules *rules) {
+	BYTE *p = (BYTE*)rules;
+	for (SIZE_T i = 0; i < sizeof *rules; i++)
+		p[i] = 0;
+}
+
+/*
+Adds a rule to the rule set. If count is 0, all keys except the trigger key are follow-up keys.
+Returns FALSE if the rule set is full.
+*/
+inline BOOL KeyFilterAddRule(struct KeyFilterRules *rules, BYTE vkCode, BYTE scanCode, DWORD timeout, const BYTE *followups, int count) {
+	struct KeyFilterRule *rule;
+	if ((rules->Triggers[vkCode >> 5] >> (vkCode & 31)) & 1)
+		rule = &rules->Rule[rules->RuleIndex[vkCode]];
+	else if (rules->Count >= NOEDGE_MAX_RULES)
+		return FALSE;
+	else {
+		rules->RuleIndex[vkCode] = (BYTE)rules->Count;
+		rules->Triggers[vkCode >> 5] |= 1u << (vkCode & 31);
+		rule = &rules->Rule[rules->Count++];
+		rule->VkCode = vkCode;
+		rule->ScanCode = scanCode;
+	}
+	if (timeout > rule->Timeout)
+		rule->Timeout = timeout;
+	if (count == 0) {
+		for (int i = 0; i < 8; i++)
+			rule->FollowUp[i] = 0xffffffff;
+	}
+	else {
+		for (int i = 0; i < count; i++)
+			rule->FollowUp[followups[i] >> 5] |= 1u << (followups[i] & 31);
+	}
+	rule->FollowUp[vkCode >> 5] &= ~(1u << (vkCode & 31));
+	return TRUE;
+}
+
+/*
+Compiles the contents of a rule file into a rule set. File format:
+- Header: 4 bytes "NERS", 1 byte version (1), 1 byte number of rules.
+- Per rule: 1 byte trigger virtual key code, 1 byte trigger scan code (0: any scan code),
+2 bytes timeout in milliseconds, little endian (0: default timeout, otherwise 8 - 1024),
+1 byte number of follow-up keys n (0: all keys), n bytes follow-up virtual key codes.
+Returns FALSE if the contents are invalid or contain no rule.
+*/
+inline BOOL KeyFilterParseRules(struct KeyFilterRules *rules, const BYTE *buffer, DWORD size) {
+	DWORD pos, len;
+	if (size < 6 || buffer[0] != 'N' || buffer[1] != 'E' || buffer[2] != 'R' || buffer[3] != 'S' || buffer[4] != 1)
+		return FALSE;
+	KeyFilterInitRules(rules);
+	for (len = buffer[5], pos = 6; len > 0; len--) {
+		if (pos + 5 > size || pos + 5 + buffer[pos + 4] > size)
+			return FALSE;
+		DWORD timeout = buffer[pos + 2] | (buffer[pos + 3] << 8);
+		if (timeout != 0 && timeout < 8)
+			timeout = 8;
+		else if (timeout > 1024)
+			timeout = 1024;
+		if (!KeyFilterAddRule(rules, buffer[pos], buffer[pos + 1], timeout, buffer + pos + 5, buffer[pos + 4]))
+			return FALSE;
+		pos += 5 + buffer[pos + 4];
+	}
+	return rules->Count > 0;
+}
+
+/*
+Returns non-zero if the given virtual key code is the trigger key of any rule. In NoEdgeIdle,
+all other keys pass without state change.
+*/
+inline DWORD KeyFilterTrigger(const struct KeyFilterRules *rules, DWORD vkCode) {
+	vkCode &= 0xff;
+	return (rules->Triggers[vkCode >> 5] >> (vkCode & 31)) & 1;
+}
+
+/*
+Returns the rule triggered by the given virtual key code, NULL if there is none.
+*/
+inline const struct KeyFilterRule *KeyFilterCandidate(const struct KeyFilterRules *rules, DWORD vkCode) {
+	vkCode &= 0xff;
+	return (rules->Triggers[vkCode >> 5] >> (vkCode & 31)) & 1 ? &rules->Rule[rules->RuleIndex[vkCode]] : NULL;
+}
+
+/*
+Returns the key class of the given key relative to rule, computed without branches: The
+trigger key with matching scan code, a follow-up key of the rule (including the trigger key
+with another scan code) or a genuine key. trigger is 0 to exclude the trigger key class,
+for a key that cannot start a sequence in NoEdgeIdle.
+*/
+inline DWORD KeyFilterClass(const struct KeyFilterRule *rule, DWORD vkCode, DWORD scanCode, DWORD trigger) {
+	vkCode &= 0xff;
+	DWORD same = vkCode == rule->VkCode;
+	DWORD isTrigger = same & ((rule->ScanCode == 0) | (rule->ScanCode == scanCode)) & trigger;
+	DWORD followUp = same | ((rule->FollowUp[vkCode >> 5] >> (vkCode & 31)) & 1);
+	return isTrigger | (((isTrigger | followUp) ^ 1) << 1);
+}
+
+/*
+Returns the table entry for the given event in the given state. rule is the rule of the
+sequence in progress or, in NoEdgeIdle state, the candidate rule of the event, never NULL.
+The index is computed with shifts from state, message class and key class.
+*/
+inline BYTE KeyFilterStep(const struct KeyFilterRule *rule, enum KeyboardState state, WPARAM wp, DWORD vkCode, DWORD scanCode, DWORD trigger) {
+	DWORD message = (wp != WM_KEYDOWN) + ((wp != WM_KEYDOWN) & (wp != WM_KEYUP));
+	return KeyFilter.Entry[NOEDGE_FILTER_INDEX(state, message, KeyFilterClass(rule, vkCode, scanCode, trigger))];
+}
+
+/*
+State of a key filter: The state machine state and the rule of the sequence in progress.
+*/
+struct KeyFilterState {
+	enum KeyboardState State;
+	const struct KeyFilterRule *Rule;
+};
+
+/*
+Processes one event: Looks up the rule, performs the transition and returns the table
+entry. The caller is responsible for the actions. In NoEdgeIdle, the candidate rule is the
+rule indexed by the key (rule 0 for keys without a rule, these are masked by the trigger
+bitmap), in all other states it is the rule of the sequence. Both selections are array
+lookups, there are no data-dependent branches.
+*/
+inline BYTE KeyFilterProcess(struct KeyFilterState *filter, const struct KeyFilterRules *rules, WPARAM wp, DWORD vkCode, DWORD scanCode) {
+	UINT_PTR idle = filter->State == NoEdgeIdle;
+	const struct KeyFilterRule *rule = (const struct KeyFilterRule*)(((UINT_PTR)&rules->Rule[rules->RuleIndex[vkCode & 0xff]] & (0 - idle))
+		| ((UINT_PTR)filter->Rule & (idle - 1)));
+	BYTE action = KeyFilterStep(rule, filter->State, wp, vkCode, scanCode, KeyFilterTrigger(rules, vkCode) | (DWORD)(idle ^ 1));
+	UINT_PTR arm = (action & NOEDGE_ARM) != 0;
+	filter->State = (enum KeyboardState)(action & NOEDGE_STATE_MASK);
+	filter->Rule = (const struct KeyFilterRule*)(((UINT_PTR)rule & (0 - arm)) | ((UINT_PTR)filter->Rule & (arm - 1)));
+	return action;
+}
+
+/*
+Processes one event of a filter with a timer that runs on another thread and can win the buffered
+key press (see CancelTimer in KeyboardHook.cpp). In NoEdgeWinPressed, every event stops the timer
+and the caller has tried that before: cancelled is FALSE if the timer had claimed the key press
+already, which has been or will be replayed. The event then sees the state the timer leaves,
+NoEdgeWaitWinRelease, as if it had fired before the event: The event is neither discarded (which
+would swallow the trigger key release after a replayed press) nor does it replay the key press a
+second time.
+*/
+inline BYTE KeyFilterProcessTimed(struct KeyFilterState *filter, const struct KeyFilterRules *rules, WPARAM wp, DWORD vkCode, DWORD scanCode, BOOL cancelled) {
+	if (filter->State == NoEdgeWinPressed && !cancelled)
+		filter->State = NoEdgeWaitWinRelease;
+	return KeyFilterProcess(filter, rules, wp, vkCode, scanCode);
+}
+
+/*
+Adaptive timeout, shared by the hook and offline simulation: Gaps between trigger key press and
+the following key event are counted in a histogram with one bucket per millisecond. After at
+least NOEDGE_GAP_MIN_SAMPLES samples, the timeout is the given percentile of all gaps plus a
+safety margin, but not below the minimum and not above the configured timeout.
+*/
+#define NOEDGE_GAP_BUCKETS 128			// Gap histogram size, one bucket per millisecond
+#define NOEDGE_GAP_MIN_SAMPLES 16		// Minimum number of samples before the timeout adapts
+#define NOEDGE_GAP_MAX_SAMPLES 1024		// Halve the histogram when reached, to prefer recent samples
+
+struct KeyFilterAdaptive {
+	DWORD Percentile;				// Percentile for adaptive timeout, 0 if disabled
+	DWORD Margin;					// Safety margin in milliseconds
+	DWORD Minimum;					// Lower limit in milliseconds
+};
+
+/*
+Adds a gap sample to histogram (with samples the sum of its buckets) and returns the adapted
+timeout. Returns timeout unchanged if the sample is out of range or there are too few samples.
+*/
+inline DWORD KeyFilterLearnGap(const struct KeyFilterAdaptive *adaptive, DWORD *histogram, DWORD *samples, DWORD gap, DWORD timeout, DWORD maximum) {
+	if (gap >= NOEDGE_GAP_BUCKETS || gap >= maximum)
+		return timeout;
+	histogram[gap]++;
+	if (++*samples >= NOEDGE_GAP_MAX_SAMPLES) {
+		*samples = 0;
+		for (int i = 0; i < NOEDGE_GAP_BUCKETS; i++)
+			*samples += (histogram[i] >>= 1);
+	}
+	if (*samples < NOEDGE_GAP_MIN_SAMPLES)
+		return timeout;
+	DWORD limit = *samples * adaptive->Percentile / 100, sum = 0, adapted;
+	for (adapted = 0; adapted < NOEDGE_GAP_BUCKETS - 1 && (sum += histogram[adapted]) <= limit; adapted++)
+		;
+	adapted += 1 + adaptive->Margin;
+	if (adapted < adaptive->Minimum)
+		adapted = adaptive->Minimum;
+	return adapted < maximum ? adapted : maximum;
+}
@@ -16,7 +16,10 @@
 */
 
 #include <Windows.h>
-#include <stdio.h>
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+#include "KeyboardHook.h"
+#include "KeyFilter.h"
 
 /*
 This DLL provides a keyboard hook procedure that filters specific keyboard
@@ -28,31 +31,498 @@ allow hotkey combinations with LEFT-WINDOWS key, a key press will be generated
 after 100 milliseconds if no further keyboard events arrive in the meantime
 (100 milliseconds is the default, it can be changed via environment variable
 NoEdgeTimeout. Minimum 32 milliseconds, maximum 1024 milliseconds).
+
+If environment variable NoEdgeTrace is set to a non-zero value, the hook
+procedure records entry and exit time of each invocation in a ring buffer
+that can be drained by the controlling process via DrainHookTrace.
+
+Environment variable NoEdgeTimer selects the timer used for the deferred key
+press: "settimer" (default) uses a thread timer which is subject to the system
+timer tick, "highres" uses a high resolution waitable timer. The latter must be
+waited for by the controlling process, see GetTimerHandle and HighResTimeout.
+"worker" moves timer handling and key press replay to a worker thread that must
+be started by the controlling process, see TimerWorker. The hook procedure only
+passes the buffered key press to the worker via a single-producer/single-consumer
+queue and never calls into the timer API itself.
+
+If environment variable NoEdgeAdaptive specifies a percentile (1 - 100), the
+timeout adapts to the gaps observed between LEFT-WINDOWS key press and the first
+following key event of discarded key sequences: After at least 16 samples, the
+timeout will be set to the given percentile of all gaps plus a safety margin
+(NoEdgeAdaptiveMargin, default 8 milliseconds), but not below NoEdgeAdaptiveMinimum
+(default 16 milliseconds) and not above NoEdgeTimeout. Gaps are counted up to 127
+milliseconds, longer gaps are not considered to be part of an edge swipe.
+
+Besides LEFT-WINDOWS, further key sequences can be filtered by a rule set passed by the
+controlling process via SetRules (see KeyFilterRule in KeyFilter.h). Each rule has its own
+trigger key, follow-up keys and timeout. A key that is neither trigger nor follow-up key
+of the current rule marks a genuine hot-key: The buffered trigger key press will be replayed
+immediately together with that key. Without a rule set, a single rule for LEFT-WINDOWS with
+all other keys as follow-up keys will be used, which is the original behavior. A rule set
+may replace NoEdgeTimeout by its own default timeout. The controlling process can pass a new
+rule set at any time to reconfigure the hook without reinstalling it.
+
+In capture mode, the hook procedure writes every key event together with its decision into
+a key trace ring (see KeyTraceHeader) passed by the controlling process via SetCapture,
+usually a view of a memory mapped trace file. Writing a record is a plain memory write,
+the file will be updated by the memory manager.
+
+With the touch pad gate (see SetGateWindow), the filter arms only within a short window after
+the controlling process has seen a touch pad contact at an edge (see OpenGate). Outside of that
+window, trigger keys pass like any other key, so neither typing nor genuine hot-keys take the
+full path or wait for the timeout.
+
+Hook time on the full path will be split into own processing and the time spent in the next
+hooks of the chain (CallNextHookEx), see HookCounters. If environment variable NoEdgeChain is
+set to a non-zero value, all events take the full path, so both are measured for every event.
+
+If environment variable NoEdgeDryRun is set to a non-zero value, replays are prepared but not
+injected (no SendInput call). Used by NoEdgeBench, which feeds the hook procedure outside of
+any hook chain.
+
+The DLL registers the ETW provider "NoEdgeShortcuts" {878392b8-6347-4840-b47a-010d75fb4f29}
+(TraceLogging, no manifest needed). It reports hook entry and exit, state transitions,
+timer arm and cancel and key press replays. Without a listening session, each event costs
+one test of the provider's enable level. To record these events alongside a system trace:
+tracelog -start NoEdge -guid #878392b8-6347-4840-b47a-010d75fb4f29 -f NoEdge.etl
 */
 
-enum KeyboardState {
-	NoEdgeIdle = 0,					// Not in hot-key sequence
-	NoEdgeWinPressed = 1,			// hot-key has been pressed
-	NoEdgeWaitWinRelease = 2,		// In hot-key sequence
-	NoEdgeIgnoreKeyEvents = 3		// Ignore key events of hot-key sequence
+#define WORKER_QUEUE_SIZE 16				// Must be a power of two
+
+// data.Hot.Slow bits. If none is set, keys that are no trigger key pass NoEdgeIdle on the fast path.
+#define NOEDGE_SLOW_TRACE		0x1		// Hook trace ring enabled
+#define NOEDGE_SLOW_CAPTURE		0x2		// Capture mode
+#define NOEDGE_SLOW_HEARTBEAT	0x4		// Heartbeat requested
+#define NOEDGE_SLOW_CHAIN		0x8		// Hook chain diagnostics
+
+// ETW keywords
+#define NOEDGE_KEYWORD_HOOK		0x1		// Hook entry and exit
+#define NOEDGE_KEYWORD_STATE	0x2		// State transitions
+#define NOEDGE_KEYWORD_TIMER	0x4		// Timer arm and cancel, key press replays
+
+TRACELOGGING_DEFINE_PROVIDER(NoEdgeProvider, "NoEdgeShortcuts",
+	(0x878392b8, 0x6347, 0x4840, 0xb4, 0x7a, 0x01, 0x0d, 0x75, 0xfb, 0x4f, 0x29));
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+#define NOEDGE_REPLAY_SIZE 8			// Maximum number of key events replayed at once
+
+/*
+Deferred key press, passed from the hook procedure to the timer worker.
+*/
+struct WorkerRequest {
+	INPUT Key;						// Key press to be replayed
+	LONG Generation;				// Identifies the key press, see data.Handoff.Armed
+	DWORD Timeout;					// Timeout in milliseconds
+	LONGLONG Armed;					// QueryPerformanceCounter at hook invocation
+	DWORD Lag;						// Milliseconds from KBDLLHOOKSTRUCT::time to hook invocation
 };
 
+/*
+Shared state. The hook thread is the hook procedure plus the functions the controlling process
+calls from its message loop (SetTimerTick, HighResTimeout, OpenGate, ReleaseTrigger). Other threads are
+the timer worker, the monitor of the controlling process (DrainHookTrace, GetTimerStats) and
+the watchdog. Each block that is written by one side only gets its own cache lines:
+- Hot: State and buffered key press, written by the hook thread only (Slow: at setup only).
+- Handoff: Claim and queue tail of the timer worker, shared by hook thread and worker.
+- Drain: Tail of the hook trace ring and latency snapshot base, written by DrainHookTrace and
+SnapshotLatency only.
+- Config: Written before the hook will be installed, read-only for all other threads afterwards.
+Later writes: Rules and Capture are replaced by a single release store, Retired is written by
+SetRules on the hook thread, which is its only reader (SetRules updates Hot.Timeout and
+Stats.Timer.Timeout as well, both hook thread blocks).
+- Stats: Timer configuration (at Init), timeout, gap histogram and early releases, written by the
+hook thread only.
+- Replayed: Statistics of deferred key presses, written by the thread that replays them only (the
+timer worker in NoEdgeWorkerTimer mode, the hook thread otherwise).
+The live counters (Hot.Counters, usually outside of data) bring their own single-writer blocks.
+Memory ordering: Ring entries and queue requests are published with WriteRelease of the head
+and released with WriteRelease of the tail, each side reads the other index with ReadAcquire.
+Pointers are published with WritePointerRelease and read with ReadPointerAcquire. The claim
+of the buffered key press (Handoff.Armed) uses InterlockedCompareExchange, a full barrier.
+*/
 __declspec(dllexport)
 struct {
-	INPUT LastKey;
-	UINT_PTR TimerID;
-	DWORD Timeout;
-	enum KeyboardState KeyState;
+	struct alignas(64) {
+		struct KeyFilterState Filter;	// State machine state and rule of the sequence in progress
+		LONG volatile Slow;			// NOEDGE_SLOW_XXX: Features that need the full hook path
+		DWORD Timeout;				// Timeout in use, adapted by LearnGap
+		INPUT LastKey;				// The buffered key press
+		DWORD ArmedTimeout;			// Timeout of the buffered key press
+		DWORD ArmedLag;				// Milliseconds from KBDLLHOOKSTRUCT::time to hook invocation
+		DWORD WinPressTime;			// KBDLLHOOKSTRUCT::time of the buffered key press
+		BOOL GapPending;			// Gap to the next key event not yet sampled
+		UINT_PTR TimerID;			// SetTimer timer, NoEdgeSetTimer only
+		LONGLONG TimerArmed;		// QueryPerformanceCounter when the timer has been armed
+		LONG Generation;			// Last generation passed to the worker
+		LONG volatile WorkerHead;	// Next request to be written
+		LONG volatile TraceHead;	// Next record to be written
+		LONG volatile TraceDropped;	// Records lost because the ring was full
+		struct HookHeartbeat Heartbeat;	// Progress of the hook procedure, see GetHookHeartbeat
+		struct HookCounters *Counters;	// Live counters, see SetCounters
+		DWORD GateWindow;			// Touch pad gate window in milliseconds, 0 if the filter is always armed
+		DWORD GateOpened;			// Time of the last touch pad edge contact, see OpenGate
+	} Hot;
+	struct alignas(64) {
+		LONG volatile Armed;		// Generation of pending key press, 0 if none. Cleared by whoever wins
+		LONG volatile WorkerTail;	// Next request to be read, written by worker only
+	} Handoff;
+	struct alignas(64) {
+		LONG volatile TraceTail;	// Next record to be drained
+		struct LatencySnapshot LatencyBase;	// Histogram counts at the previous SnapshotLatency
+		struct LatencyHistogram DownstreamBase;	// Histogram counts at the previous SnapshotDownstream
+	} Drain;
+	struct alignas(64) {
+		const struct KeyFilterRules *Rules;	// Rule set in use
+		struct KeyTraceHeader *Capture;	// Key trace ring in capture mode, NULL otherwise
+		DWORD CaptureMask;			// Capacity of the key trace ring - 1
+		HANDLE TimerHandle;			// Waitable timer, NoEdgeHighResTimer and NoEdgeWorkerTimer only
+		HANDLE WorkerEvent;			// Signaled by the hook whenever the queue becomes non-empty
+		struct KeyFilterAdaptive Adaptive;	// Adaptive timeout parameters, Percentile 0 if disabled
+		BOOL Trace;					// Tracing enabled
+		BOOL PowerAware;			// Let deferred key presses coalesce with other timers
+		BOOL DryRun;				// Do not inject replays, see NoEdgeDryRun
+		BOOL Initialized;			// Init has been called
+		ULONGLONG TickScale;		// Nanoseconds per QueryPerformanceCounter tick, times 2^20
+		DWORD Timeout;				// NoEdgeTimeout, used by rule sets without default timeout
+		struct KeyFilterRule Retired;	// Copy of the rule of a key sequence that started before SetRules
+	} Config;
+	struct alignas(64) {
+		struct TimerStats Timer;	// Replay fields and CurrentTimeout unused, see GetTimerStats
+		DWORD GapHistogram[NOEDGE_GAP_BUCKETS];
+	} Stats;
+	struct alignas(64) {
+		DWORD Fired;				// Number of deferred key presses
+		LONGLONG SumTicks;			// Sum of all arm-to-press delays
+		LONGLONG MinTicks;			// Shortest arm-to-press delay
+		LONGLONG MaxTicks;			// Longest arm-to-press delay
+		LONGLONG SumTimeout;		// Sum of the timeouts of all deferred key presses in milliseconds
+	} Replayed;
+	struct WorkerRequest WorkerQueue[WORKER_QUEUE_SIZE];	// Written by hook thread, read by worker
+	struct HookTraceRecord TraceRing[NOEDGE_TRACE_SIZE];	// Written by hook thread, read by DrainHookTrace
+	struct KeyFilterRules DefaultRules;		// LEFT-WINDOWS only, part of Config
+	struct HookCounters DefaultCounters;	// Counters until SetCounters, blocks as in HookCounters
 } data;
 
+/*
+Replay buffer: Key events to be injected by one SendInput call, which takes one pass through the
+hook chain for the whole sequence instead of one per event. All events will be tagged with
+NOEDGE_EXTRA_INFO, the hook procedure passes them without running the state machine.
+*/
+struct ReplayBuffer {
+	UINT Count;
+	INPUT Keys[NOEDGE_REPLAY_SIZE];
+};
+
+static void ReplayAdd(struct ReplayBuffer *replay, const INPUT *key) {
+	if (replay->Count < NOEDGE_REPLAY_SIZE) {
+		INPUT *next = &replay->Keys[replay->Count++];
+		*next = *key;
+		next->ki.dwExtraInfo = NOEDGE_EXTRA_INFO;
+	}
+}
+
+static void ReplayAddEvent(struct ReplayBuffer *replay, const KBDLLHOOKSTRUCT *hs) {
+	if (replay->Count < NOEDGE_REPLAY_SIZE) {
+		INPUT *next = &replay->Keys[replay->Count++];
+		next->type = INPUT_KEYBOARD;
+		next->ki.wVk = (WORD)hs->vkCode;
+		next->ki.wScan = (WORD)hs->scanCode;
+		next->ki.dwFlags = ((hs->flags & LLKHF_EXTENDED) ? KEYEVENTF_EXTENDEDKEY : 0) | ((hs->flags & LLKHF_UP) ? KEYEVENTF_KEYUP : 0);
+		next->ki.time = 0;
+		next->ki.dwExtraInfo = NOEDGE_EXTRA_INFO;
+	}
+}
+
+static void ReplayFlush(struct ReplayBuffer *replay) {
+	if (replay->Count > 0 && !data.Config.DryRun)
+		SendInput(replay->Count, replay->Keys, sizeof *replay->Keys);
+	replay->Count = 0;
+}
+
+/*
+Changes the state from NoEdgeWinPressed to NoEdgeWaitWinRelease outside of the state machine,
+when the buffered trigger key press will be or has been replayed.
+*/
+static void LeaveWinPressed() {
+	data.Hot.Filter.State = NoEdgeWaitWinRelease;
+}
+
+/*
+Replays a deferred key press and updates the timer statistics. Will be called from
+the thread that owns the timer: The hook thread or, in NoEdgeWorkerTimer mode, the
+timer worker.
+*/
+static inline ULONGLONG TicksToNs(LONGLONG ticks) {
+	return ((ULONGLONG)ticks * data.Config.TickScale) >> 20;
+}
+
+static void ReplayKey(INPUT *key, LONGLONG armed, DWORD lag, DWORD timeout) {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	LONGLONG delay = now.QuadPart - armed;
+	if (data.Replayed.Fired++ == 0 || delay < data.Replayed.MinTicks)
+		data.Replayed.MinTicks = delay;
+	if (delay > data.Replayed.MaxTicks)
+		data.Replayed.MaxTicks = delay;
+	data.Replayed.SumTicks += delay;
+	data.Replayed.SumTimeout += timeout;
+	struct HookCounters *counters = (struct HookCounters*)ReadPointerAcquire((PVOID volatile*)&data.Hot.Counters);
+	counters->Timer.Replayed++;
+	struct ReplayBuffer replay;
+	replay.Count = 0;
+	ReplayAdd(&replay, key);
+	ReplayFlush(&replay);
+	QueryPerformanceCounter(&now);
+	counters->Timer.Delay.Count[LatencyBucket(TicksToNs(now.QuadPart - armed) + lag * 1000000ULL)]++;
+	TraceLoggingWrite(NoEdgeProvider, "Replay", TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(NOEDGE_KEYWORD_TIMER),
+		TraceLoggingUInt16(key->ki.wVk, "VkCode"), TraceLoggingUInt32(timeout, "Timeout"), TraceLoggingInt64(delay, "DelayTicks"));
+}
+
 /*
 Timeout handler, will be invoked Timeout milliseconds after reception
 (and discarding) of a LEFT-WINDOWS key press event. If another key input
-event occurred in the meantime, the timer will be discarded.
+event occurred in the meantime, the timer will be discarded. The state leaves
+NoEdgeWinPressed before the replay: The replayed key press bypasses the state machine
+and genuine key events that arrive in the meantime see the new state.
 */
 static void __stdcall NoEdgeWindowsKeyTimeout(HWND, UINT, UINT_PTR, DWORD) {
-	if (data.KeyState == NoEdgeWinPressed)
-		SendInput(1, &data.LastKey, sizeof data.LastKey);
+	if (data.Hot.Filter.State == NoEdgeWinPressed) {
+		if (data.Stats.Timer.Mode == NoEdgeSetTimer && data.Hot.TimerID != 0)
+			KillTimer(NULL, data.Hot.TimerID);
+		LeaveWinPressed();
+		ReplayKey(&data.Hot.LastKey, data.Hot.TimerArmed, data.Hot.ArmedLag, data.Hot.ArmedTimeout);
+	}
+}
+
+/*
+The timer worker, must be run in its own thread by the controlling process if the
+worker timer has been selected. The parameter is an event that stops the worker when
+signaled. The worker takes deferred key presses from the queue, waits until their
+timeout elapses and replays them unless the hook has claimed them in the meantime:
+Both sides try to reset data.Handoff.Armed from the generation of the key press to zero, only
+the winner acts. If the hook wins, the key press is discarded. If the worker wins,
+the hook leaves NoEdgeWinPressed when it sees the lost claim with the next key event.
+*/
+static DWORD WINAPI TimerWorker(LPVOID stop) {
+	HANDLE handles[3] = { (HANDLE)stop, data.Config.WorkerEvent, data.Config.TimerHandle };
+	struct WorkerRequest pending = { 0 };
+	while (1) {
+		DWORD ret = WaitForMultipleObjects(3, handles, FALSE, INFINITE);
+		if (ret == WAIT_OBJECT_0 + 1) {
+			LONG tail = data.Handoff.WorkerTail, head = ReadAcquire(&data.Hot.WorkerHead);
+			if (tail != head) {
+				// Only the latest request can still be armed, older ones have been claimed by the hook.
+				pending = data.WorkerQueue[(head - 1) & (WORKER_QUEUE_SIZE - 1)];
+				WriteRelease(&data.Handoff.WorkerTail, head);
+				LARGE_INTEGER due;
+				due.QuadPart = -10000LL * pending.Timeout;
+				SetWaitableTimer(data.Config.TimerHandle, &due, 0, NULL, NULL, FALSE);
+			}
+		}
+		else if (ret == WAIT_OBJECT_0 + 2) {
+			if (pending.Generation != 0 && InterlockedCompareExchange(&data.Handoff.Armed, 0, pending.Generation) == pending.Generation) {
+				pending.Key.ki.time = 0;
+				ReplayKey(&pending.Key, pending.Armed, pending.Lag, pending.Timeout);
+			}
+			pending.Generation = 0;
+		}
+		else
+			break;
+	}
+	CancelWaitableTimer(data.Config.TimerHandle);
+	return 0;
+}
+
+/*
+Timeout handler for the high resolution timer, must be invoked by the controlling
+process whenever the handle returned by GetTimerHandle becomes signaled. The time
+component of the key event will be set by the system.
+*/
+static void HighResTimeout() {
+	data.Hot.LastKey.ki.time = 0;
+	NoEdgeWindowsKeyTimeout(NULL, 0, 0, 0);
+}
+
+/*
+Returns the waitable timer handle if the high resolution timer has been selected.
+Otherwise, NULL will be returned and the timer will be handled by WM_TIMER dispatch.
+*/
+static HANDLE GetTimerHandle() {
+	return data.Stats.Timer.Mode == NoEdgeHighResTimer ? data.Config.TimerHandle : NULL;
+}
+
+/*
+Copies the current timer statistics into stats, composed from the blocks of their writers
+(Stats, Replayed and the timeout in use). Writes nothing, any thread may call it. The fields
+of one writer may be torn against each other, they are statistics.
+*/
+static void GetTimerStats(struct TimerStats *stats) {
+	*stats = data.Stats.Timer;
+	stats->Fired = data.Replayed.Fired;
+	stats->SumTicks = data.Replayed.SumTicks;
+	stats->MinTicks = data.Replayed.MinTicks;
+	stats->MaxTicks = data.Replayed.MaxTicks;
+	stats->SumTimeout = data.Replayed.SumTimeout;
+	stats->CurrentTimeout = data.Hot.Timeout;
+}
+
+/*
+Adds the gap between LEFT-WINDOWS key press and the following key event to the gap histogram
+and recomputes the adaptive timeout. Samples will be taken from discarded sequences and from
+key events that follow shortly after a deferred key press: In the latter case, the timeout
+was probably too short and the sample lets the timeout grow again.
+*/
+static void LearnGap(DWORD gap) {
+	data.Hot.GapPending = FALSE;
+	data.Hot.Timeout = KeyFilterLearnGap(&data.Config.Adaptive, data.Stats.GapHistogram, &data.Stats.Timer.GapSamples,
+		gap, data.Hot.Timeout, data.Stats.Timer.Timeout);
+}
+
+/*
+Starts the timer for the deferred key press and stops it. With the high resolution timer,
+setting the timer resets its signaled state, a pending signal of a cancelled timer will
+be ignored by NoEdgeWindowsKeyTimeout because the state has changed in the meantime.
+With the worker timer, arming means queueing a request for the worker and waking it,
+stopping means claiming the request back without any system call.
+In eco mode (NoEdgePower=eco), the timer may fire up to TimerTolerance late to coalesce with
+other timers of the system, otherwise it must not be coalesced at all.
+ArmTimer returns FALSE if the timer could not be started. In that case, the key press
+must not be discarded. CancelTimer returns FALSE if the timer has won the buffered key press,
+it has been or will be replayed. Only the worker timer can win, the other timers run on the
+hook thread and see the state change.
+*/
+static DWORD TimerTolerance() {
+	return data.Hot.ArmedTimeout / 16 > 0 ? data.Hot.ArmedTimeout / 16 : 1;
+}
+
+static BOOL ArmTimer() {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	data.Hot.TimerArmed = now.QuadPart;
+	if (data.Stats.Timer.Mode == NoEdgeWorkerTimer) {
+		LONG head = data.Hot.WorkerHead;
+		if (head - ReadAcquire(&data.Handoff.WorkerTail) >= WORKER_QUEUE_SIZE)
+			return FALSE;
+		struct WorkerRequest *req = &data.WorkerQueue[head & (WORKER_QUEUE_SIZE - 1)];
+		if (++data.Hot.Generation == 0)
+			data.Hot.Generation = 1;
+		req->Key = data.Hot.LastKey;
+		req->Generation = data.Hot.Generation;
+		req->Timeout = data.Hot.ArmedTimeout;
+		req->Armed = now.QuadPart;
+		req->Lag = data.Hot.ArmedLag;
+		WriteRelease(&data.Handoff.Armed, data.Hot.Generation);
+		WriteRelease(&data.Hot.WorkerHead, head + 1);
+		SetEvent(data.Config.WorkerEvent);
+		return TRUE;
+	}
+	else if (data.Stats.Timer.Mode == NoEdgeHighResTimer) {
+		LARGE_INTEGER due;
+		due.QuadPart = -10000LL * data.Hot.ArmedTimeout;
+		return SetWaitableTimerEx(data.Config.TimerHandle, &due, 0, NULL, NULL, NULL, data.Config.PowerAware ? TimerTolerance() : 0);
+	}
+	return (data.Hot.TimerID = SetCoalescableTimer(NULL, 0, data.Hot.ArmedTimeout, NoEdgeWindowsKeyTimeout,
+		data.Config.PowerAware ? TimerTolerance() : TIMERV_NO_COALESCING)) != 0;
+}
+
+static BOOL CancelTimer() {
+	TraceLoggingWrite(NoEdgeProvider, "TimerCancel", TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(NOEDGE_KEYWORD_TIMER),
+		TraceLoggingUInt32(data.Stats.Timer.Mode, "Mode"));
+	if (data.Stats.Timer.Mode == NoEdgeWorkerTimer)
+		return InterlockedCompareExchange(&data.Handoff.Armed, 0, data.Hot.Generation) == data.Hot.Generation;
+	if (data.Stats.Timer.Mode == NoEdgeHighResTimer)
+		CancelWaitableTimer(data.Config.TimerHandle);
+	else if (data.Hot.TimerID != 0)
+		KillTimer(NULL, data.Hot.TimerID);
+	return TRUE;
+}
+
+/*
+Replays the buffered trigger key press at once instead of waiting for the timeout, if it is
+still buffered and has the given key codes. Must be called from the hook thread, for controlling
+processes that know the source of the key press from elsewhere. It can't be the raw input of the
+key press: The hook has discarded it, so there is none. NoEdge.exe decides at the key press
+instead, by the touch pad gate.
+In worker mode, the key press may have been claimed by the worker already.
+*/
+static void ReleaseTrigger(DWORD vkCode, DWORD scanCode) {
+	if (data.Hot.Filter.State != NoEdgeWinPressed || data.Hot.Filter.Rule->VkCode != vkCode
+		|| (data.Hot.Filter.Rule->ScanCode != 0 && data.Hot.Filter.Rule->ScanCode != scanCode))
+		return;
+	if (!CancelTimer())
+		return;
+	// Leave NoEdgeWinPressed now: A timer signal that is already pending must not replay again.
+	LeaveWinPressed();
+	data.Stats.Timer.Released++;
+	data.Hot.Counters->Hook.Cancelled++;
+	data.Hot.Counters->Hook.Released++;
+	struct ReplayBuffer replay;
+	replay.Count = 0;
+	data.Hot.LastKey.ki.time = 0;
+	ReplayAdd(&replay, &data.Hot.LastKey);
+	ReplayFlush(&replay);
+}
+
+/*
+Touch pad gate: With a window of 0 (the default), the filter is always armed. Otherwise, it arms
+only for key events up to window milliseconds after the last touch pad edge contact passed to
+OpenGate. Must be called from the hook thread. The gate starts closed.
+*/
+static void SetGateWindow(DWORD window) {
+	data.Hot.GateOpened = GetTickCount() - window - 1;
+	data.Hot.GateWindow = window;
+}
+
+/*
+Opens the touch pad gate at time (GetTickCount, as KBDLLHOOKSTRUCT::time) of a touch pad
+contact at an edge. Must be called from the hook thread.
+*/
+static void OpenGate(DWORD time) {
+	data.Hot.GateOpened = time;
+}
+
+// TRUE if the touch pad gate is enabled and closed for a key event at time.
+static __forceinline BOOL GateClosed(DWORD time) {
+	return data.Hot.GateWindow != 0 && time - data.Hot.GateOpened > data.Hot.GateWindow;
+}
+
+/*
+Replays the buffered trigger key press, immediately followed by the key event in hs, in
+one batch. Used when a genuine key follows the trigger key.
+*/
+static void ReplayChord(WPARAM wp, const KBDLLHOOKSTRUCT *hs) {
+	struct ReplayBuffer replay;
+	replay.Count = 0;
+	data.Hot.LastKey.ki.time = 0;
+	ReplayAdd(&replay, &data.Hot.LastKey);
+	ReplayAddEvent(&replay, hs);
+	ReplayFlush(&replay);
+	TraceLoggingWrite(NoEdgeProvider, "ReplayChord", TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(NOEDGE_KEYWORD_TIMER),
+		TraceLoggingUInt16(data.Hot.LastKey.ki.wVk, "VkCode"), TraceLoggingUInt32(hs->vkCode, "ChordVkCode"));
+}
+
+/*
+Sets the rule set to be used by the hook procedure, a snapshot of the configuration that
+must stay unchanged while in use. NULL selects the default rule set (LEFT-WINDOWS only).
+Must be called from the hook thread, between two key events: A key sequence in progress
+finishes with a copy of its rule, so the previous rule set is no longer in use when SetRules
+returns and may be reused by the controlling process. A new default timeout restarts the
+adaptive timeout from there.
+*/
+static void SetRules(const struct KeyFilterRules *rules) {
+	if (rules == NULL)
+		rules = &data.DefaultRules;
+	if (data.Hot.Filter.State != NoEdgeIdle && data.Hot.Filter.Rule != NULL) {
+		data.Config.Retired = *data.Hot.Filter.Rule;
+		data.Hot.Filter.Rule = &data.Config.Retired;
+	}
+	DWORD timeout = rules->Timeout == 0 ? data.Config.Timeout : rules->Timeout < 32 ? 32 : rules->Timeout > 1024 ? 1024 : rules->Timeout;
+	if (timeout != data.Stats.Timer.Timeout)
+		data.Hot.Timeout = data.Stats.Timer.Timeout = timeout;
+	WritePointerRelease((PVOID volatile*)&data.Config.Rules, (PVOID)rules);
 }
 
 /*
@@ -62,11 +532,141 @@ before calling TranslateMessage and DispatchMessage to create a better
 key press event during invokation of NoEdgeWindowsKeyTimeout.
 */
 static void SetTimerTick(DWORD tick) {
-	data.LastKey.ki.time = tick;
+	data.Hot.LastKey.ki.time = tick;
 }
 
 /*
-The keyboard hook procedure. Handles LEFT-WINDOWS key press events as follows:
+Stores one trace record. Single producer: Called from the hook procedure only.
+If the ring is full, the record will be dropped instead of waiting for the
+consumer, the hook must never block.
+*/
+static void TraceHookEvent(LONGLONG entry, LONGLONG exit, DWORD time, enum KeyboardState from, BOOL swallowed) {
+	LONG head = data.Hot.TraceHead;
+	if (head - ReadAcquire(&data.Drain.TraceTail) >= NOEDGE_TRACE_SIZE) {
+		data.Hot.TraceDropped++;
+		return;
+	}
+	struct HookTraceRecord *rec = &data.TraceRing[head & (NOEDGE_TRACE_SIZE - 1)];
+	rec->Entry = entry;
+	rec->Exit = exit;
+	rec->Time = time;
+	rec->OldState = (BYTE)from;
+	rec->NewState = (BYTE)data.Hot.Filter.State;
+	rec->Swallowed = swallowed ? 1 : 0;
+	// Publish the record: The consumer must not see the new head before the record contents.
+	WriteRelease(&data.Hot.TraceHead, head + 1);
+}
+
+/*
+Copies up to count trace records into buffer and releases them for reuse by the hook.
+Single consumer: Must not be called concurrently from more than one thread.
+Returns the number of records copied or -1 if tracing is disabled. If dropped
+is not NULL, the number of records dropped so far will be stored there.
+*/
+static int DrainHookTrace(struct HookTraceRecord *buffer, int count, LONG *dropped) {
+	if (!data.Config.Trace)
+		return -1;
+	LONG tail = data.Drain.TraceTail, head = ReadAcquire(&data.Hot.TraceHead);
+	int i;
+	for (i = 0; i < count && tail != head; i++, tail++)
+		buffer[i] = data.TraceRing[tail & (NOEDGE_TRACE_SIZE - 1)];
+	// Release the slots: The hook must not overwrite them before they have been copied.
+	WriteRelease(&data.Drain.TraceTail, tail);
+	if (dropped != NULL)
+		*dropped = ReadNoFence(&data.Hot.TraceDropped);
+	return i;
+}
+
+/*
+Sets the key trace ring for capture mode, NULL stops capturing. The capacity of the ring
+must be a power of two, the records follow the header immediately. The ring must stay
+valid until capturing has been stopped.
+*/
+static void SetCapture(struct KeyTraceHeader *capture) {
+	if (capture != NULL) {
+		data.Config.CaptureMask = capture->Capacity - 1;
+		WritePointerRelease((PVOID volatile*)&data.Config.Capture, capture);
+		InterlockedOr(&data.Hot.Slow, NOEDGE_SLOW_CAPTURE);
+	}
+	else {
+		InterlockedAnd(&data.Hot.Slow, ~NOEDGE_SLOW_CAPTURE);
+		WritePointerRelease((PVOID volatile*)&data.Config.Capture, capture);
+	}
+}
+
+/*
+Writes one key event with its decision into the key trace ring. Called from the hook
+procedure only, old records will be overwritten when the ring is full.
+*/
+static void CaptureKeyEvent(struct KeyTraceHeader *capture, WPARAM wp, const KBDLLHOOKSTRUCT *hs, BYTE decision) {
+	LONG head = capture->Head;
+	struct KeyTraceRecord *rec = (struct KeyTraceRecord*)(capture + 1) + (head & data.Config.CaptureMask);
+	rec->VkCode = hs->vkCode;
+	rec->ScanCode = hs->scanCode;
+	rec->Flags = hs->flags;
+	rec->Time = hs->time;
+	rec->ExtraInfo = hs->dwExtraInfo;
+	rec->Message = (WORD)wp;
+	rec->Decision = decision;
+	rec->Label = 0;
+	rec->Reserved = 0;
+	WriteRelease(&capture->Head, head + 1);
+}
+
+/*
+Returns the heartbeat of the hook procedure, for watchdogs in other threads. From now on, all
+events take the full hook path, which maintains the heartbeat.
+*/
+static const struct HookHeartbeat *GetHookHeartbeat() {
+	InterlockedOr(&data.Hot.Slow, NOEDGE_SLOW_HEARTBEAT);
+	return &data.Hot.Heartbeat;
+}
+
+/*
+Sets the block the hook procedure and the replaying thread write their live counters to (see
+HookCounters). NULL selects the internal block. The header of the block is up to the caller, its
+counters must be zero. Must not be called concurrently with SnapshotLatency or SnapshotDownstream.
+*/
+static void SetCounters(struct HookCounters *counters) {
+	for (int i = 0; i < NOEDGE_HISTOGRAM_BUCKETS; i++)
+		data.Drain.LatencyBase.Hook.Count[i] = data.Drain.DownstreamBase.Count[i] = data.Drain.LatencyBase.Replay.Count[i] = 0;
+	WritePointerRelease((PVOID volatile*)&data.Hot.Counters, counters != NULL ? counters : &data.DefaultCounters);
+}
+
+/*
+Stores the latency histograms since the previous call in snapshot. The hook never resets its
+histograms, counts only grow (and wrap around), the snapshot is the difference to the counts
+seen by the previous call. Single consumer: Must not be called concurrently from more than one
+thread.
+*/
+static void SnapshotLatency(struct LatencySnapshot *snapshot) {
+	const struct HookCounters *counters = (const struct HookCounters*)ReadPointerAcquire((PVOID volatile*)&data.Hot.Counters);
+	for (int i = 0; i < NOEDGE_HISTOGRAM_BUCKETS; i++) {
+		WORD hook = counters->Hook.Latency.Count[i], replay = counters->Timer.Delay.Count[i];
+		snapshot->Hook.Count[i] = (WORD)(hook - data.Drain.LatencyBase.Hook.Count[i]);
+		snapshot->Replay.Count[i] = (WORD)(replay - data.Drain.LatencyBase.Replay.Count[i]);
+		data.Drain.LatencyBase.Hook.Count[i] = hook;
+		data.Drain.LatencyBase.Replay.Count[i] = replay;
+	}
+}
+
+/*
+Stores the histogram of the time spent in the next hooks of the chain since the previous call
+in histogram, same semantics as SnapshotLatency.
+*/
+static void SnapshotDownstream(struct LatencyHistogram *histogram) {
+	const struct HookCounters *counters = (const struct HookCounters*)ReadPointerAcquire((PVOID volatile*)&data.Hot.Counters);
+	for (int i = 0; i < NOEDGE_HISTOGRAM_BUCKETS; i++) {
+		WORD downstream = counters->Hook.Downstream.Count[i];
+		histogram->Count[i] = (WORD)(downstream - data.Drain.DownstreamBase.Count[i]);
+		data.Drain.DownstreamBase.Count[i] = downstream;
+	}
+}
+
+#pragma code_seg(push, ".text$cold")
+/*
+The full path of the keyboard hook procedure. Looks up the event in the key filter table (see KeyFilter.h)
+and carries out the actions found there. Handles LEFT-WINDOWS key press events as follows:
 - Buffers the event and sets a timer of NoEdgeTimeout milliseconds
 - If another key event arrives before the timer elapses, the timer will be killed
 and all key events until (and inclusive) LEFT-WINDOWS release will be discarded.
@@ -76,67 +676,219 @@ LEFT-WINDOW key press event with all parameters set as in the original key event
 component of the original key event with the time component of the WM_TIMER
 message.
 */
-static LRESULT CALLBACK NoEdgeKeyboardHook(int code, WPARAM wp, LPARAM lp) {
+static __declspec(noinline) LRESULT HookFullPath(int code, WPARAM wp, LPARAM lp) {
+	LARGE_INTEGER entry, next, exit;
+	QueryPerformanceCounter(&entry);
 	if (code == HC_ACTION) {
 		KBDLLHOOKSTRUCT *hs = (KBDLLHOOKSTRUCT*)lp;
-		switch (data.KeyState) {
-		case NoEdgeIdle:
-			if (wp == WM_KEYDOWN && hs->scanCode == 0x5b && hs->vkCode == 0x5b) {
-				data.KeyState = NoEdgeWinPressed;
-				data.LastKey.type = INPUT_KEYBOARD;
-				data.LastKey.ki.dwExtraInfo = hs->dwExtraInfo;
-				data.LastKey.ki.dwFlags = KEYEVENTF_EXTENDEDKEY;
-				data.LastKey.ki.time = hs->time;
-				data.LastKey.ki.wScan = (WORD)hs->scanCode;
-				data.LastKey.ki.wVk = (WORD)hs->vkCode;
-				data.TimerID = SetTimer(NULL, 0, data.Timeout, NoEdgeWindowsKeyTimeout);
-				return -1;
+		struct HookCounters *counters = data.Hot.Counters;
+		// Every event stops the timer in NoEdgeWinPressed (NOEDGE_CANCEL). The worker may have won
+		// the buffered key press in the meantime, see KeyFilterProcessTimed.
+		BOOL cancelled = data.Hot.Filter.State != NoEdgeWinPressed || CancelTimer();
+		enum KeyboardState from = data.Hot.Filter.State;
+		data.Hot.Heartbeat.Time = hs->time;
+		data.Hot.Heartbeat.Entry = GetTickCount();
+		WriteRelease(&data.Hot.Heartbeat.Count, data.Hot.Heartbeat.Count + 1);
+		TraceLoggingWrite(NoEdgeProvider, "HookEntry", TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(NOEDGE_KEYWORD_HOOK),
+			TraceLoggingUInt32((DWORD)wp, "Message"), TraceLoggingUInt32(hs->vkCode, "VkCode"), TraceLoggingUInt32(hs->scanCode, "ScanCode"),
+			TraceLoggingUInt32(hs->flags, "Flags"), TraceLoggingUInt32(hs->time, "Time"));
+		const struct KeyFilterRules *rules = (const struct KeyFilterRules*)ReadPointerAcquire((PVOID volatile*)&data.Config.Rules);
+		BYTE action = 0;
+		// A closed touch pad gate keeps the state machine in NoEdgeIdle.
+		if (from != NoEdgeIdle || !GateClosed(hs->time))
+			action = KeyFilterProcessTimed(&data.Hot.Filter, rules, wp, hs->vkCode, hs->scanCode, cancelled);
+		else if (KeyFilterTrigger(rules, hs->vkCode))
+			counters->Hook.Gated++;
+		BOOL swallow = (action & NOEDGE_SWALLOW) != 0;
+		if (action & (NOEDGE_ARM | NOEDGE_CANCEL | NOEDGE_SAMPLE | NOEDGE_REPLAY)) {
+			if (action & NOEDGE_CANCEL)
+				counters->Hook.Cancelled++;
+			if ((action & NOEDGE_SAMPLE) && data.Hot.GapPending)
+				LearnGap(hs->time - data.Hot.WinPressTime);
+			if (action & NOEDGE_REPLAY) {
+				ReplayChord(wp, hs);
+				counters->Hook.Chords++;
 			}
-			break;
-		case NoEdgeWinPressed:
-			if (data.TimerID != 0)
-				KillTimer(NULL, data.TimerID);
-			if (wp != WM_KEYDOWN || hs->scanCode != 0x5b || hs->vkCode != 0x5b) {
-				data.KeyState = NoEdgeIgnoreKeyEvents;
-		case NoEdgeIgnoreKeyEvents:
-				if (wp == WM_KEYUP && hs->scanCode == 0x5b && hs->vkCode == 0x5b)
-					data.KeyState = NoEdgeIdle;
-				return -1;
+			if (action & NOEDGE_ARM) {
+				data.Hot.LastKey.type = INPUT_KEYBOARD;
+				data.Hot.LastKey.ki.dwExtraInfo = hs->dwExtraInfo;
+				data.Hot.LastKey.ki.dwFlags = (hs->flags & LLKHF_EXTENDED) ? KEYEVENTF_EXTENDEDKEY : 0;
+				data.Hot.LastKey.ki.time = hs->time;
+				data.Hot.LastKey.ki.wScan = (WORD)hs->scanCode;
+				data.Hot.LastKey.ki.wVk = (WORD)hs->vkCode;
+				data.Hot.ArmedTimeout = data.Hot.Filter.Rule->Timeout != 0 ? data.Hot.Filter.Rule->Timeout : data.Hot.Timeout;
+				data.Hot.WinPressTime = hs->time;
+				data.Hot.ArmedLag = GetTickCount() - hs->time;
+				data.Hot.GapPending = data.Config.Adaptive.Percentile > 0;
+				BOOL armed = ArmTimer();
+				TraceLoggingWrite(NoEdgeProvider, "TimerArm", TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(NOEDGE_KEYWORD_TIMER),
+					TraceLoggingUInt32(data.Stats.Timer.Mode, "Mode"), TraceLoggingUInt32(data.Hot.ArmedTimeout, "Timeout"), TraceLoggingBool(armed, "Armed"));
+				if (!armed) {
+					data.Hot.Filter.State = NoEdgeWaitWinRelease;
+					swallow = FALSE;
+				}
+				else
+					counters->Hook.Armed++;
 			}
-			else
-				data.KeyState = NoEdgeWaitWinRelease;
-			break;
-		case NoEdgeWaitWinRelease:
-			if (wp == WM_KEYUP && hs->scanCode == 0x5b && hs->vkCode == 0x5b)
-				data.KeyState = NoEdgeIdle;
-			break;
 		}
+		if (data.Hot.Filter.State != from)
+			TraceLoggingWrite(NoEdgeProvider, "StateTransition", TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(NOEDGE_KEYWORD_STATE),
+				TraceLoggingUInt8((BYTE)from, "From"), TraceLoggingUInt8((BYTE)data.Hot.Filter.State, "To"), TraceLoggingUInt8(action, "Action"));
+		struct KeyTraceHeader *capture = (struct KeyTraceHeader*)ReadPointerAcquire((PVOID volatile*)&data.Config.Capture);
+		if (capture != NULL)
+			CaptureKeyEvent(capture, wp, hs, swallow ? action : action & ~NOEDGE_SWALLOW);
+		if (data.Hot.Filter.State == NoEdgeIgnoreKeyEvents && from != NoEdgeIgnoreKeyEvents)
+			counters->Hook.Ignored++;
+		QueryPerformanceCounter(&next);
+		LRESULT ret = swallow ? -1 : CallNextHookEx(0, code, wp, lp);
+		QueryPerformanceCounter(&exit);
+		counters->Hook.Full++;
+		if (swallow)
+			counters->Hook.Swallowed++;
+		else
+			counters->Hook.Downstream.Count[LatencyBucket(TicksToNs(exit.QuadPart - next.QuadPart))]++;
+		counters->Hook.Latency.Count[LatencyBucket(TicksToNs(next.QuadPart - entry.QuadPart))]++;
+		if (data.Config.Trace)
+			TraceHookEvent(entry.QuadPart, exit.QuadPart, hs->time, from, swallow);
+		TraceLoggingWrite(NoEdgeProvider, "HookExit", TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE), TraceLoggingKeyword(NOEDGE_KEYWORD_HOOK),
+			TraceLoggingUInt32(hs->time, "Time"), TraceLoggingBool(swallow, "Swallowed"));
+		WriteRelease(&data.Hot.Heartbeat.Count, data.Hot.Heartbeat.Count + 1);
+		return ret;
 	}
 	return CallNextHookEx(0, code, wp, lp);
 }
+#pragma code_seg(pop)
+
+/*
+The keyboard hook procedure. Key events injected by the hook itself (tagged with NOEDGE_EXTRA_INFO)
+will be passed first, without any state change or system call: Whoever injects them has changed
+the state already. In NoEdgeIdle, which is where the hook spends almost all its time,
+keys that are no trigger key pass without any state change: Unless a feature needs to see every
+event (data.Hot.Slow), they take the fast path of one test of state and features, one bit test in
+the trigger bitmap, one counter increment and the call of the next hook. Trigger keys take the
+fast path as well while the touch pad gate is closed. Everything else takes the full path, which
+lives in its own code section apart from the fast path. ETW hook entry and exit events will be
+written for events on the full path only.
+*/
+static LRESULT CALLBACK NoEdgeKeyboardHook(int code, WPARAM wp, LPARAM lp) {
+	if (code == HC_ACTION && (((KBDLLHOOKSTRUCT*)lp)->flags & LLKHF_INJECTED) && ((KBDLLHOOKSTRUCT*)lp)->dwExtraInfo == NOEDGE_EXTRA_INFO)
+		return CallNextHookEx(0, code, wp, lp);
+	if ((data.Hot.Filter.State | data.Hot.Slow) == 0 && code == HC_ACTION
+		&& !KeyFilterTrigger((const struct KeyFilterRules*)ReadPointerAcquire((PVOID volatile*)&data.Config.Rules), ((KBDLLHOOKSTRUCT*)lp)->vkCode)) {
+		data.Hot.Counters->Hook.Fast++;
+		return CallNextHookEx(0, code, wp, lp);
+	}
+	if ((data.Hot.Filter.State | data.Hot.Slow) == 0 && code == HC_ACTION && GateClosed(((KBDLLHOOKSTRUCT*)lp)->time)) {
+		data.Hot.Counters->Hook.Gated++;
+		return CallNextHookEx(0, code, wp, lp);
+	}
+	return HookFullPath(code, wp, lp);
+}
+
+/*
+Reads the decimal number in environment variable name into value. Returns FALSE, leaving value
+unchanged, if the variable does not exist or does not consist of 1 - 9 digits.
+*/
+static BOOL GetEnvironmentNumber(const char *name, DWORD *value) {
+	char buffer[16];
+	DWORD len = GetEnvironmentVariableA(name, buffer, sizeof buffer), number = 0;
+	if (len == 0 || len > 9)
+		return FALSE;
+	for (DWORD i = 0; i < len; i++) {
+		if (buffer[i] < '0' || buffer[i] > '9')
+			return FALSE;
+		number = number * 10 + buffer[i] - '0';
+	}
+	*value = number;
+	return TRUE;
+}
 
 /*
-DLL initialization / finalization:
-- Open / close the log file (environment variable NoEdgeLog),
-- Initialize timeout (from environment variable NoEdgeTimeout).
+Initialization, must be called by the controlling process before the hook will be installed.
+Calling it again has no effect. Configuration will not be read in DllMain to keep the loader
+lock short, and without any heap allocation or C runtime call: The dll is built without C
+runtime startup code.
+- Initialize timeout (from environment variable NoEdgeTimeout),
+- Select and create the timer (from environment variable NoEdgeTimer),
+- Initialize adaptive timeout (from environment variables NoEdgeAdaptive,
+NoEdgeAdaptiveMargin and NoEdgeAdaptiveMinimum),
+- Enable tracing (from environment variable NoEdgeTrace),
+- Enable hook chain diagnostics (from environment variable NoEdgeChain),
+- Enable timer coalescing (from environment variable NoEdgePower),
+- Disable replay injection (from environment variable NoEdgeDryRun),
+- Initialize the default rule set,
+- Register the ETW provider.
+*/
+static BOOL Init() {
+	char buffer[16];
+	DWORD len, value;
+	if (data.Config.Initialized)
+		return TRUE;
+	TraceLoggingRegister(NoEdgeProvider);
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	data.Config.TickScale = (1000000000ULL << 20) / frequency.QuadPart;
+	data.Hot.Timeout = 100;
+	if (GetEnvironmentNumber("NoEdgeTimeout", &value))
+		data.Hot.Timeout = value < 32 ? 32 : value > 1024 ? 1024 : value;
+	data.Hot.Filter.State = NoEdgeIdle;
+	data.Stats.Timer.Timeout = data.Config.Timeout = data.Hot.Timeout;
+	KeyFilterInitRules(&data.DefaultRules);
+	KeyFilterAddRule(&data.DefaultRules, 0x5b, 0x5b, 0, NULL, 0);
+	data.Config.Rules = &data.DefaultRules;
+	data.Hot.Counters = &data.DefaultCounters;
+	if ((len = GetEnvironmentVariableA("NoEdgeTimer", buffer, sizeof buffer)) > 0 && len < sizeof buffer
+		&& (lstrcmpiA(buffer, "highres") == 0 || lstrcmpiA(buffer, "worker") == 0)) {
+		// Fall back to a normal waitable timer if the system does not support high resolution timers
+		data.Config.TimerHandle = CreateWaitableTimerExW(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+		data.Stats.Timer.HighResolution = data.Config.TimerHandle != NULL;
+		if (data.Config.TimerHandle == NULL)
+			data.Config.TimerHandle = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS);
+		if (data.Config.TimerHandle == NULL)
+			;
+		else if (lstrcmpiA(buffer, "highres") == 0)
+			data.Stats.Timer.Mode = NoEdgeHighResTimer;
+		else if ((data.Config.WorkerEvent = CreateEventA(NULL, FALSE, FALSE, NULL)) != NULL)
+			data.Stats.Timer.Mode = NoEdgeWorkerTimer;
+	}
+	if (GetEnvironmentNumber("NoEdgeAdaptive", &value) && value > 0 && value <= 100) {
+		data.Config.Adaptive.Percentile = value;
+		data.Stats.Timer.Adaptive = TRUE;
+	}
+	data.Config.Adaptive.Margin = 8;
+	GetEnvironmentNumber("NoEdgeAdaptiveMargin", &data.Config.Adaptive.Margin);
+	data.Config.Adaptive.Minimum = 16;
+	GetEnvironmentNumber("NoEdgeAdaptiveMinimum", &data.Config.Adaptive.Minimum);
+	data.Config.Trace = GetEnvironmentNumber("NoEdgeTrace", &value) && value != 0;
+	if (data.Config.Trace)
+		data.Hot.Slow |= NOEDGE_SLOW_TRACE;
+	if (GetEnvironmentNumber("NoEdgeChain", &value) && value != 0)
+		data.Hot.Slow |= NOEDGE_SLOW_CHAIN;
+	data.Config.PowerAware = (len = GetEnvironmentVariableA("NoEdgePower", buffer, sizeof buffer)) > 0 && len < sizeof buffer
+		&& lstrcmpiA(buffer, "eco") == 0;
+	data.Config.DryRun = GetEnvironmentNumber("NoEdgeDryRun", &value) && value != 0;
+	data.Config.Initialized = TRUE;
+	return TRUE;
+}
+
+/*
+DLL entry point, called directly by the loader (no C runtime startup). Finalization only:
+- Close the timer handles,
+- Unregister the ETW provider.
 */
 extern "C" BOOL WINAPI DllMain(HINSTANCE instance, DWORD reason, LPVOID res) {
 	switch (reason) {
 	case DLL_PROCESS_ATTACH:
-		{
-			char *buffer = new char[100];
-			int len;
-			if ((len = GetEnvironmentVariableA("NoEdgeTimeout", buffer, 100)) <= 0 || len >= 5)
-				data.Timeout = 100;
-			else if ((len = atoi(buffer)) < 32)
-				data.Timeout = 32;
-			else if (len > 1024)
-				data.Timeout = 1024;
-			else
-				data.Timeout = len;
-			data.KeyState = NoEdgeIdle;
-		}
+		DisableThreadLibraryCalls(instance);
+		break;
 	case DLL_PROCESS_DETACH:
+		if (!data.Config.Initialized)
+			break;
+		TraceLoggingUnregister(NoEdgeProvider);
+		if (data.Config.TimerHandle != NULL)
+			CloseHandle(data.Config.TimerHandle);
+		if (data.Config.WorkerEvent != NULL)
+			CloseHandle(data.Config.WorkerEvent);
 		break;
 	}
 	return TRUE;
@@ -145,6 +897,7 @@ extern "C" BOOL WINAPI DllMain(HINSTANCE instance, DWORD reason, LPVOID res) {
 /*
 Returns lowest function and data address of keyboard hook dll in parameter addresses and the corresponding
 estimated code and data length in minlength.
+NoEdge.exe locks the dll by its PE section headers instead, this estimate is kept for compatibility.
 */
 static void GetDllInfo(void *addresses[2], SIZE_T minlength[2]) {
 	SIZE_T minaddr = -1, maxaddr = 0, current, add = 0;
@@ -157,6 +910,46 @@ static void GetDllInfo(void *addresses[2], SIZE_T minlength[2]) {
 		minaddr = current;
 	else if (current > maxaddr)
 		maxaddr = current;
+	if ((current = (SIZE_T)TraceHookEvent) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
+	if ((current = (SIZE_T)HighResTimeout) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
+	if ((current = (SIZE_T)ArmTimer) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
+	if ((current = (SIZE_T)CancelTimer) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
+	if ((current = (SIZE_T)LearnGap) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
+	if ((current = (SIZE_T)ReplayKey) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
+	if ((current = (SIZE_T)TimerWorker) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
+	if ((current = (SIZE_T)ReplayChord) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
+	if ((current = (SIZE_T)HookFullPath) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
+	if ((current = (SIZE_T)CaptureKeyEvent) < minaddr)
+		minaddr = current;
+	else if (current > maxaddr)
+		maxaddr = current;
 	if ((current = (SIZE_T)DllMain) > maxaddr && (add == 0 || current < maxaddr + add))
 		add = current - maxaddr;
 	if ((current = (SIZE_T)GetDllInfo) > maxaddr && (add == 0 || current < maxaddr + add))
@@ -172,12 +965,62 @@ static void GetDllInfo(void *addresses[2], SIZE_T minlength[2]) {
 	}
 }
 
+static const struct NoEdgeFunctions functions = {
+	NOEDGE_API_VERSION,
+	sizeof functions,
+	NoEdgeKeyboardHook,
+	Init,
+	SetTimerTick,
+	GetDllInfo,
+	DrainHookTrace,
+	GetTimerHandle,
+	HighResTimeout,
+	GetTimerStats,
+	TimerWorker,
+	SetRules,
+	SetCapture,
+	GetHookHeartbeat,
+	ReleaseTrigger,
+	SetCounters,
+	SnapshotLatency,
+	SetGateWindow,
+	OpenGate,
+	SnapshotDownstream
+};
+
+/*
+Returns the table of all entry points (see NoEdgeFunctions) or NULL if the caller has been
+built for another ABI version.
+*/
+extern "C" __declspec(dllexport)
+const struct NoEdgeFunctions *GetNoEdgeFunctions(DWORD version) {
+	return version == NOEDGE_API_VERSION ? &functions : NULL;
+}
+
+/*
+Legacy entry point resolution by integer index, see NoEdgeFunctions for the typed table.
+SetCounters (13) and SnapshotLatency (14) are no longer resolved: Their structures have changed
+with the smaller histograms and an older caller would misread them. Older callers do not know
+Init, which sets up the default rule set and counters the hook procedure depends on: It will be
+called here (on the caller's thread, outside of the loader lock).
+*/
 extern "C" __declspec(dllexport)
 void* GetFunctionAddress(int index) {
+	Init();
 	switch (index) {
 	case 0:	return NoEdgeKeyboardHook;
 	case 1:	return SetTimerTick;
 	case 2: return GetDllInfo;
+	case 3: return DrainHookTrace;
+	case 4: return GetTimerHandle;
+	case 5: return HighResTimeout;
+	case 6: return GetTimerStats;
+	case 7: return TimerWorker;
+	case 8: return SetRules;
+	case 9: return SetCapture;
+	case 10: return GetHookHeartbeat;
+	case 11: return Init;
+	case 12: return ReleaseTrigger;
 	}
 	return NULL;
 }
@@ -0,0 +1,257 @@
+/*
+* Copyright 2021 Martin Conrad
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+* http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*
+*/
+
+#pragma once
+
+#include <Windows.h>
+
+/*
+Declarations shared between the keyboard hook dll (KeyboardHook.cpp) and the
+controlling process (NoEdge.cpp).
+*/
+
+enum KeyboardState {
+	NoEdgeIdle = 0,					// Not in hot-key sequence
+	NoEdgeWinPressed = 1,			// hot-key has been pressed
+	NoEdgeWaitWinRelease = 2,		// In hot-key sequence
+	NoEdgeIgnoreKeyEvents = 3		// Ignore key events of hot-key sequence
+};
+
+/*
+One entry of the hook trace ring. The hook procedure fills one record per
+keyboard event if tracing has been enabled via environment variable NoEdgeTrace.
+Timestamps are raw QueryPerformanceCounter values, conversion is up to the reader.
+*/
+struct HookTraceRecord {
+	LONGLONG Entry;					// QueryPerformanceCounter at hook entry
+	LONGLONG Exit;					// QueryPerformanceCounter at hook exit
+	DWORD Time;						// KBDLLHOOKSTRUCT::time of the event
+	BYTE OldState;					// KeyboardState before the event
+	BYTE NewState;					// KeyboardState after the event
+	BYTE Swallowed;					// Non-zero if the event has been discarded
+	BYTE Reserved;
+};
+
+// Number of records in the trace ring, must be a power of two.
+#define NOEDGE_TRACE_SIZE 256
+
+/*
+Heartbeat of the hook procedure as returned by GetHookHeartbeat. Count will be incremented on
+entry and on exit of each invocation, an odd value means an invocation is in progress. Time is
+KBDLLHOOKSTRUCT::time of the current or last event, Entry is GetTickCount at entry of the current
+or last invocation (the event time can lie well before). All are written by the hook thread only,
+Time and Entry before Count.
+*/
+struct HookHeartbeat {
+	LONG volatile Count;
+	DWORD volatile Time;
+	DWORD volatile Entry;
+};
+
+/*
+Timer backends for the deferred LEFT-WINDOWS key press, selected via environment
+variable NoEdgeTimer ("settimer", "highres" or "worker").
+*/
+enum TimerMode {
+	NoEdgeSetTimer = 0,				// Thread timer, fired via WM_TIMER dispatch
+	NoEdgeHighResTimer = 1,			// Waitable timer, waited for by the message loop
+	NoEdgeWorkerTimer = 2			// Waitable timer, owned by a worker thread
+};
+
+/*
+Timer statistics as returned by GetTimerStats. Times are raw QueryPerformanceCounter
+ticks between arming the timer and the deferred key press, conversion is up to the reader.
+With adaptive timeout, the timeout of each deferred key press may differ, SumTimeout
+allows computing the average lateness anyway.
+*/
+struct TimerStats {
+	enum TimerMode Mode;			// Selected backend
+	BOOL HighResolution;			// High resolution waitable timer available
+	DWORD Timeout;					// Configured (maximum) timeout in milliseconds
+	DWORD Fired;					// Number of deferred key presses
+	LONGLONG SumTicks;				// Sum of all arm-to-press delays
+	LONGLONG MinTicks;				// Shortest arm-to-press delay
+	LONGLONG MaxTicks;				// Longest arm-to-press delay
+	LONGLONG SumTimeout;			// Sum of the timeouts of all deferred key presses in milliseconds
+	BOOL Adaptive;					// Adaptive timeout enabled
+	DWORD CurrentTimeout;			// Timeout currently in use in milliseconds
+	DWORD GapSamples;				// Number of samples in the gap histogram
+	DWORD Released;					// Trigger key presses released early by ReleaseTrigger
+};
+
+/*
+Log-linear latency histogram in nanoseconds: Values below 4 have a bucket each, every power of
+two above is split into 4 buckets, which keeps the relative error below 25 %. The buckets cover
+values up to 2^32 - 1 ns (4.3 s), longer values go into the last bucket. A histogram takes 248
+bytes: The three of HookCounters, the internal block of the dll and the snapshot bases take
+2.2 KB together, the hook data still fits into its locked pages. Counts are 16 bits and
+wrap around: A reader has to take the difference to its previous reading at least every 65535
+events of a bucket, NoEdge.exe does so on every wakeup of its monitor thread (at most 1 s).
+*/
+#define NOEDGE_HISTOGRAM_BUCKETS 124
+
+struct LatencyHistogram {
+	WORD Count[NOEDGE_HISTOGRAM_BUCKETS];
+};
+
+inline int LatencyBucket(ULONGLONG ns) {
+	unsigned long exponent;
+	if (ns < 4)
+		return (int)ns;
+	if (ns > 0xffffffff)
+		return NOEDGE_HISTOGRAM_BUCKETS - 1;
+	_BitScanReverse(&exponent, (DWORD)ns);
+	return (int)((exponent - 1) * 4 + ((ns >> (exponent - 2)) & 3));
+}
+
+// Lowest value of a bucket, the highest value of a bucket is the lowest value of the next one - 1.
+inline ULONGLONG LatencyBucketValue(int bucket) {
+	return bucket < 4 ? bucket : (ULONGLONG)(4 + bucket % 4) << (bucket / 4 - 1);
+}
+
+/*
+Latency histograms since the previous snapshot as returned by SnapshotLatency: Own processing
+time of full path invocations and delay from KBDLLHOOKSTRUCT::time of a buffered key press to
+its replay after the timeout. The part of the delay up to the hook invocation has the
+resolution of the system tick, the rest is measured with QueryPerformanceCounter. The time
+spent in the next hooks of the chain by full path invocations (not for discarded events) has
+its own entry point SnapshotDownstream, the layout of this structure is part of the API version.
+*/
+struct LatencySnapshot {
+	struct LatencyHistogram Hook;
+	struct LatencyHistogram Replay;
+};
+
+/*
+Live counters of the hook procedure, written into a block passed by the controlling process via
+SetCounters, usually a view of a named file mapping (see NoEdge.cpp). Each part has a single
+writer and its own cache lines: Hook is written by the hook thread, Timer by the thread that
+replays deferred key presses. Readers poll without any synchronization, each counter is an
+aligned DWORD (WORD for histogram buckets) that wraps around. Events on the fast path are
+counted only, the latency histograms cover full path invocations and replays after the timeout
+(see LatencySnapshot).
+Each armed timer is either cancelled or replayed: Armed - Hook.Cancelled - Timer.Replayed is the
+number of pending key presses, 0 or 1.
+*/
+#define NOEDGE_COUNTERS_MAGIC "NEHC"
+#define NOEDGE_COUNTERS_VERSION 5
+
+struct HookCounters {
+	char Magic[4];					// NOEDGE_COUNTERS_MAGIC, set by the controlling process
+	DWORD Version;					// NOEDGE_COUNTERS_VERSION
+	LONGLONG Frequency;				// QueryPerformanceFrequency
+	DWORD ProcessId;				// Controlling process
+	struct alignas(64) {
+		DWORD Fast;					// Events passed by the fast path
+		DWORD Full;					// Events processed by the full path
+		DWORD Swallowed;			// Events discarded
+		DWORD Ignored;				// Sequences moved to NoEdgeIgnoreKeyEvents
+		DWORD Armed;				// Timers armed for a buffered key press
+		DWORD Cancelled;			// Timers cancelled, early releases (Released) included
+		DWORD Chords;				// Buffered key presses replayed with a genuine key
+		DWORD Released;				// Buffered key presses released early by ReleaseTrigger
+		DWORD Gated;				// Trigger key events passed because the touch pad gate was closed
+		struct LatencyHistogram Latency;	// Full path invocations by own processing time
+		struct LatencyHistogram Downstream;	// Full path invocations by time in CallNextHookEx
+	} Hook;
+	struct alignas(64) {
+		DWORD Replayed;				// Buffered key presses replayed after their timeout
+		struct LatencyHistogram Delay;	// Replays by delay from the original key event
+	} Timer;
+};
+
+/*
+KBDLLHOOKSTRUCT::dwExtraInfo of all key events injected by the keyboard hook ("NOED"). The hook
+recognizes its own replays by this tag, their original extra information will be lost.
+*/
+#define NOEDGE_EXTRA_INFO ((ULONG_PTR)0x4e4f4544)
+
+/*
+Key event trace files. A trace file starts with a KeyTraceHeader, followed by Capacity
+fixed size KeyTraceRecord entries used as a ring: Head counts all records ever written,
+so if Head exceeds Capacity, the oldest record is at index Head % Capacity.
+Traces are written by the capture mode of the keyboard hook and read by NoEdgeBench.
+*/
+#define NOEDGE_TRACE_MAGIC "NETR"
+#define NOEDGE_TRACE_VERSION 1
+
+// KeyTraceRecord::Decision for events without recorded decision
+#define NOEDGE_NO_DECISION 0xff
+
+// KeyTraceRecord::Label bits
+#define NOEDGE_LABEL_KNOWN		0x01	// Label is valid
+#define NOEDGE_LABEL_PHANTOM	0x02	// Event has been generated by the touch pad
+
+struct KeyTraceHeader {
+	char Magic[4];					// NOEDGE_TRACE_MAGIC
+	WORD Version;					// NOEDGE_TRACE_VERSION
+	WORD RecordSize;				// sizeof(struct KeyTraceRecord)
+	DWORD Capacity;					// Number of records in the file
+	LONG volatile Head;				// Number of records written
+	DWORD Reserved[4];
+};
+
+struct KeyTraceRecord {
+	DWORD VkCode;					// KBDLLHOOKSTRUCT::vkCode
+	DWORD ScanCode;					// KBDLLHOOKSTRUCT::scanCode
+	DWORD Flags;					// KBDLLHOOKSTRUCT::flags
+	DWORD Time;						// KBDLLHOOKSTRUCT::time
+	ULONG64 ExtraInfo;				// KBDLLHOOKSTRUCT::dwExtraInfo
+	WORD Message;					// Message (wParam of the hook procedure)
+	BYTE Decision;					// Key filter table entry of the event or NOEDGE_NO_DECISION
+	BYTE Label;						// NOEDGE_LABEL_XXX bits
+	DWORD Reserved;
+};
+
+static_assert(sizeof(struct KeyTraceHeader) == 32 && sizeof(struct KeyTraceRecord) == 32, "Trace file layout must not change");
+
+/*
+Entry points of the keyboard hook dll, all at once as returned by its export GetNoEdgeFunctions.
+Version is the ABI version: The dll returns its table only if the caller requests the version
+it has been built with, any incompatible change of an entry point or of a structure passed
+through one needs a new version. New entry points will be appended and raise Size, a caller
+can use entries up to the Size it finds. All entries of a returned table are valid.
+GetFunctionAddress (integer index, untyped) is kept for older callers.
+*/
+#define NOEDGE_API_VERSION 2
+
+struct KeyFilterRules;
+
+struct NoEdgeFunctions {
+	DWORD Version;					// NOEDGE_API_VERSION
+	DWORD Size;						// sizeof(struct NoEdgeFunctions) of the dll
+	HOOKPROC KeyboardHook;
+	BOOL(*Init)();
+	void(*SetTimerTick)(DWORD);
+	void(*GetDllInfo)(void *addresses[2], SIZE_T minlength[2]);
+	int(*DrainHookTrace)(struct HookTraceRecord*, int, LONG*);
+	HANDLE(*GetTimerHandle)();
+	void(*HighResTimeout)();
+	void(*GetTimerStats)(struct TimerStats*);
+	LPTHREAD_START_ROUTINE TimerWorker;
+	void(*SetRules)(const struct KeyFilterRules*);
+	void(*SetCapture)(struct KeyTraceHeader*);
+	const struct HookHeartbeat*(*GetHookHeartbeat)();
+	void(*ReleaseTrigger)(DWORD, DWORD);
+	void(*SetCounters)(struct HookCounters*);
+	void(*SnapshotLatency)(struct LatencySnapshot*);
+	void(*SetGateWindow)(DWORD);
+	void(*OpenGate)(DWORD);
+	void(*SnapshotDownstream)(struct LatencyHistogram*);
+};
+
+typedef const struct NoEdgeFunctions *(*GetNoEdgeFunctionsProc)(DWORD version);
@@ -16,6 +16,15 @@ limitations under the License.
 
 #include <Windows.h>
 #include <Psapi.h>
+#include <avrt.h>
+#include <sddl.h>
+#include <hidusage.h>
+#include <hidpi.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <share.h>
+#include "KeyboardHook.h"
+#include "KeyFilter.h"
 
 inline void errorExit(const char*, int exitcode) {
 	exit(exitcode);
@@ -33,20 +42,1427 @@ static bool equal(const char*s1, const char*s2) {
 	return false;
 }
 
-static void messageLoop(void(*setTimerTick)(DWORD)) {
+/*
+Report output. If environment variable NoEdgeLog specifies a file name, all reports
+will be appended to that file. Otherwise, reports will be discarded. The file is shared for
+reading while it is open.
+*/
+static FILE *logFile;
+
+static void openLog() {
+	char name[MAX_PATH];
+	int len;
+	if ((len = GetEnvironmentVariableA("NoEdgeLog", name, sizeof name)) > 0 && len < sizeof name)
+		logFile = _fsopen(name, "a", _SH_DENYWR);
+}
+
+static void logPrintf(const char *format, ...) {
+	if (logFile != NULL) {
+		SYSTEMTIME now;
+		va_list args;
+		GetLocalTime(&now);
+		fprintf(logFile, "%04d-%02d-%02d %02d:%02d:%02d.%03d ", now.wYear, now.wMonth, now.wDay, now.wHour, now.wMinute, now.wSecond, now.wMilliseconds);
+		va_start(args, format);
+		vfprintf(logFile, format, args);
+		va_end(args);
+		fputc('\n', logFile);
+		fflush(logFile);
+	}
+}
+
+/*
+Working set pinning. Everything the hook thread touches will be locked into the working set
+to avoid page faults during hook processing: All code and data sections of NoEdge.exe and
+NoEdgeShortcuts.dll as given by their PE section headers, the rule set and the capture header.
+Each lock grows the working set minimum first, VirtualLock fails when the locked pages would
+exceed it. lockedBytes counts the bytes locked successfully, lockedRanges keeps the first
+NOEDGE_LOCKED_RANGES ranges for the watchdog.
+*/
+#define NOEDGE_LOCKED_RANGES 32
+
+static SIZE_T lockedBytes;
+static struct {
+	BYTE *Address;
+	SIZE_T Size;
+} lockedRanges[NOEDGE_LOCKED_RANGES];
+static int lockedCount;
+
+static BOOL lockMemory(void *address, SIZE_T size) {
+	SYSTEM_INFO info;
+	SIZE_T minimum, maximum;
+	DWORD flags;
+	GetSystemInfo(&info);
+	SIZE_T page = info.dwPageSize, first = (SIZE_T)address & ~(page - 1);
+	size = (((SIZE_T)address + size + page - 1) & ~(page - 1)) - first;
+	if (GetProcessWorkingSetSizeEx(GetCurrentProcess(), &minimum, &maximum, &flags)) {
+		minimum += size;
+		if (maximum < minimum + 16 * page)
+			maximum = minimum + 16 * page;
+		SetProcessWorkingSetSizeEx(GetCurrentProcess(), minimum, maximum, flags);
+	}
+	if (!VirtualLock((void*)first, size))
+		return FALSE;
+	lockedBytes += size;
+	if (lockedCount < NOEDGE_LOCKED_RANGES) {
+		lockedRanges[lockedCount].Address = (BYTE*)first;
+		lockedRanges[lockedCount++].Size = size;
+	}
+	return TRUE;
+}
+
+/*
+Locks all sections of a loaded module that can be touched at run time: Code, writable data and
+read-only data (constant tables, import address table). Discardable sections (relocations) and
+resources will be skipped. Returns FALSE if any section could not be locked.
+*/
+static BOOL lockImage(HMODULE module) {
+	BYTE *base = (BYTE*)module;
+	IMAGE_DOS_HEADER *dos = (IMAGE_DOS_HEADER*)base;
+	if (dos->e_magic != IMAGE_DOS_SIGNATURE)
+		return FALSE;
+	IMAGE_NT_HEADERS *nt = (IMAGE_NT_HEADERS*)(base + dos->e_lfanew);
+	if (nt->Signature != IMAGE_NT_SIGNATURE)
+		return FALSE;
+	IMAGE_SECTION_HEADER *section = IMAGE_FIRST_SECTION(nt);
+	BOOL ok = TRUE;
+	for (int i = 0; i < nt->FileHeader.NumberOfSections; i++, section++) {
+		if ((section->Characteristics & IMAGE_SCN_MEM_DISCARDABLE) || memcmp(section->Name, ".rsrc", 6) == 0)
+			continue;
+		if (section->Characteristics & (IMAGE_SCN_MEM_EXECUTE | IMAGE_SCN_MEM_WRITE | IMAGE_SCN_CNT_INITIALIZED_DATA | IMAGE_SCN_CNT_UNINITIALIZED_DATA)) {
+			if (section->Misc.VirtualSize > 0 && !lockMemory(base + section->VirtualAddress, section->Misc.VirtualSize))
+				ok = FALSE;
+		}
+	}
+	return ok;
+}
+
+/*
+Hook latency statistics, accumulated from the trace ring of the keyboard hook dll.
+Latencies below one millisecond are counted with microsecond resolution, longer
+latencies with millisecond resolution. Everything above one second goes into the
+last bucket.
+*/
+#define LATENCY_BUCKETS 2000
+
+static struct {
+	LONGLONG Frequency;
+	ULONGLONG Events;
+	ULONGLONG Swallowed;
+	LONG Dropped;
+	double Max;
+	ULONGLONG Buckets[LATENCY_BUCKETS];
+} latency;
+
+static void addLatency(const struct HookTraceRecord *rec) {
+	double us = (double)(rec->Exit - rec->Entry) * 1000000.0 / latency.Frequency;
+	int index = us < 1000.0 ? (int)us : 999 + (int)(us / 1000.0);
+	latency.Buckets[index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1]++;
+	latency.Events++;
+	if (rec->Swallowed)
+		latency.Swallowed++;
+	if (us > latency.Max)
+		latency.Max = us;
+}
+
+/*
+Returns the latency in microseconds below which the given percentage of all events lies.
+*/
+static double latencyPercentile(double percent) {
+	ULONGLONG limit = (ULONGLONG)(latency.Events * percent / 100.0), sum = 0;
+	for (int i = 0; i < LATENCY_BUCKETS; i++) {
+		if ((sum += latency.Buckets[i]) > limit)
+			return i < 1000 ? i + 1 : (i - 998) * 1000.0;
+	}
+	return latency.Max;
+}
+
+static void(*GetTimerStats)(struct TimerStats*);
+
+static const char *timerName(const struct TimerStats *stats) {
+	return stats->Mode == NoEdgeSetTimer ? "settimer" : stats->Mode == NoEdgeWorkerTimer ? "worker" : stats->HighResolution ? "highres" : "waitable";
+}
+
+static void reportTimer() {
+	struct TimerStats stats;
+	GetTimerStats(&stats);
+	if (stats.Fired > 0) {
+		double tick = 1000.0 / latency.Frequency, timeout = (double)stats.SumTimeout / stats.Fired;
+		logPrintf("timer %s: %lu deferred presses, delay min %.3f ms, avg %.3f ms, max %.3f ms, avg timeout %.1f ms", timerName(&stats),
+			stats.Fired, stats.MinTicks * tick, (double)stats.SumTicks / stats.Fired * tick, stats.MaxTicks * tick, timeout);
+	}
+	if (stats.Adaptive)
+		logPrintf("adaptive timeout: %lu ms (maximum %lu ms), %lu gap samples", stats.CurrentTimeout, stats.Timeout, stats.GapSamples);
+	if (stats.Released > 0)
+		logPrintf("raw input: %lu key presses from real keyboards released without timeout", stats.Released);
+}
+
+static char scheduling[100] = "default";
+
+static void reportLatency() {
+	if (latency.Events > 0)
+		logPrintf("hook latency (%s): %llu events, %llu swallowed, %ld dropped, p50 %.0f us, p99 %.0f us, max %.1f us",
+			scheduling, latency.Events, latency.Swallowed, latency.Dropped, latencyPercentile(50), latencyPercentile(99), latency.Max);
+}
+
+/*
+Always-on latency histograms of the hook dll (see LatencySnapshot), reported with each latency
+report for the period since the previous report. Unlike the trace based latency, they need
+neither tracing nor the monitor to keep up with the hook. Hook time is split into our own
+processing and the next hooks of the chain (downstream): A high downstream share points to
+other low level hooks on the system rather than to the hook dll. The means are estimated from
+the lowest value of each bucket. The 16 bit counts of the hook are taken on every wakeup of the
+monitor and summed up here until the report.
+*/
+static void(*SnapshotLatency)(struct LatencySnapshot*);
+static void(*SnapshotDownstream)(struct LatencyHistogram*);
+static LONG volatile chainRehooks;			// Reinstallations, periodic or after a timeout, see installHook
+
+struct LatencyTotals {
+	ULONGLONG Hook[NOEDGE_HISTOGRAM_BUCKETS];
+	ULONGLONG Downstream[NOEDGE_HISTOGRAM_BUCKETS];
+	ULONGLONG Replay[NOEDGE_HISTOGRAM_BUCKETS];
+};
+
+static struct LatencyTotals latencyTotals;
+
+static ULONGLONG histogramPercentile(const ULONGLONG *histogram, ULONGLONG total, double percent) {
+	ULONGLONG limit = (ULONGLONG)(total * percent / 100.0), sum = 0;
+	for (int i = 0; i < NOEDGE_HISTOGRAM_BUCKETS - 1; i++) {
+		if ((sum += histogram[i]) > limit)
+			return LatencyBucketValue(i + 1) - 1;
+	}
+	return LatencyBucketValue(NOEDGE_HISTOGRAM_BUCKETS - 1);
+}
+
+static double histogramMean(const ULONGLONG *histogram, ULONGLONG total) {
+	double sum = 0;
+	for (int i = 0; i < NOEDGE_HISTOGRAM_BUCKETS; i++)
+		sum += (double)LatencyBucketValue(i) * histogram[i];
+	return total > 0 ? sum / total : 0;
+}
+
+static void sampleHistograms() {
+	struct LatencySnapshot snapshot;
+	struct LatencyHistogram downstream;
+	SnapshotLatency(&snapshot);
+	SnapshotDownstream(&downstream);
+	for (int i = 0; i < NOEDGE_HISTOGRAM_BUCKETS; i++) {
+		latencyTotals.Hook[i] += snapshot.Hook.Count[i];
+		latencyTotals.Downstream[i] += downstream.Count[i];
+		latencyTotals.Replay[i] += snapshot.Replay.Count[i];
+	}
+}
+
+static void reportHistograms() {
+	const struct LatencyTotals *totals = &latencyTotals;
+	ULONGLONG hook = 0, downstream = 0, replay = 0;
+	sampleHistograms();
+	for (int i = 0; i < NOEDGE_HISTOGRAM_BUCKETS; i++) {
+		hook += totals->Hook[i];
+		downstream += totals->Downstream[i];
+		replay += totals->Replay[i];
+	}
+	if (hook > 0) {
+		double own = histogramMean(totals->Hook, hook) * hook, next = histogramMean(totals->Downstream, downstream) * downstream;
+		logPrintf("hook time: %llu full path events, own p50 %.2f us, p99 %.2f us, downstream p50 %.2f us, p99 %.2f us, "
+			"downstream share %.0f %%, %ld reinstallations", hook,
+			histogramPercentile(totals->Hook, hook, 50) / 1000.0, histogramPercentile(totals->Hook, hook, 99) / 1000.0,
+			histogramPercentile(totals->Downstream, downstream, 50) / 1000.0, histogramPercentile(totals->Downstream, downstream, 99) / 1000.0,
+			own + next > 0 ? next * 100 / (own + next) : 0.0, chainRehooks);
+	}
+	if (replay > 0)
+		logPrintf("replay delay: %llu deferred presses, p50 %.2f ms, p99 %.2f ms", replay,
+			histogramPercentile(totals->Replay, replay, 50) / 1000000.0, histogramPercentile(totals->Replay, replay, 99) / 1000000.0);
+	memset(&latencyTotals, 0, sizeof latencyTotals);
+}
+
+/*
+The monitor thread drains the trace ring of the keyboard hook dll periodically and writes
+latency and timer reports every NoEdgeReport seconds (default 600) and when it will be
+stopped. It only reads the ring, the hook thread will never wait for it.
+*/
+static HANDLE monitorStop;
+static int(*DrainHookTrace)(struct HookTraceRecord*, int, LONG*);
+
+static void drainTrace() {
+	struct HookTraceRecord records[64];
+	int count;
+	while ((count = DrainHookTrace(records, sizeof records / sizeof *records, &latency.Dropped)) > 0) {
+		for (int i = 0; i < count; i++)
+			addLatency(&records[i]);
+	}
+}
+
+/*
+Power mode. If environment variable NoEdgePower is "eco", the process runs with EcoQoS and the
+monitor thread wakes up via a coalescable timer (period 1 second, tolerable delay 500 ms)
+instead of a precise 200 ms period. The hook thread and the timer worker opt out of EcoQoS once,
+when they start: A thread blocked in its message loop costs no power at any QoS, and switching
+QoS around each buffered trigger key press would put a system call on the hook path. Deferred key
+presses may coalesce with other timers by a few milliseconds (see ArmTimer in KeyboardHook.cpp).
+Wakeups of all threads of the process are counted and reported per hour, in both modes.
+*/
+static BOOL ecoMode;
+static LONG volatile wakeups;
+static ULONGLONG wakeupsSince;
+
+static void setPowerMode() {
+	char buffer[20];
+	int len;
+	wakeupsSince = GetTickCount64();
+	if ((len = GetEnvironmentVariableA("NoEdgePower", buffer, sizeof buffer)) > 0 && len < sizeof buffer && equal(buffer, "eco")) {
+		PROCESS_POWER_THROTTLING_STATE state;
+		state.Version = PROCESS_POWER_THROTTLING_CURRENT_VERSION;
+		state.ControlMask = PROCESS_POWER_THROTTLING_EXECUTION_SPEED;
+		state.StateMask = PROCESS_POWER_THROTTLING_EXECUTION_SPEED;
+		ecoMode = SetProcessInformation(GetCurrentProcess(), ProcessPowerThrottling, &state, sizeof state);
+		if (!ecoMode)
+			logPrintf("cannot enable EcoQoS, error %lu", GetLastError());
+	}
+}
+
+static void preciseThread(HANDLE thread) {
+	if (ecoMode) {
+		THREAD_POWER_THROTTLING_STATE state;
+		state.Version = THREAD_POWER_THROTTLING_CURRENT_VERSION;
+		state.ControlMask = THREAD_POWER_THROTTLING_EXECUTION_SPEED;
+		state.StateMask = 0;
+		SetThreadInformation(thread, ThreadPowerThrottling, &state, sizeof state);
+	}
+}
+
+static void reportWakeups() {
+	ULONGLONG elapsed = GetTickCount64() - wakeupsSince;
+	if (elapsed > 0)
+		logPrintf("wakeups (%s mode): %ld, %.0f per hour", ecoMode ? "eco" : "normal", wakeups, wakeups * 3600000.0 / elapsed);
+}
+
+/*
+Each report starts with a header naming the scheduling mode (see setScheduling), the timer
+backend and the power mode it was taken with, so reports of different configurations can be
+told apart in the same log.
+*/
+static void report() {
+	struct TimerStats stats;
+	GetTimerStats(&stats);
+	logPrintf("report (%s, timer %s, %s power)", scheduling, timerName(&stats), ecoMode ? "eco" : "normal");
+	reportLatency();
+	reportHistograms();
+	reportTimer();
+	reportWakeups();
+}
+
+static DWORD WINAPI monitor(LPVOID) {
+	char buffer[20];
+	int len;
+	DWORD interval = 600, elapsed = 0, period = ecoMode ? 1000 : 200;
+	if ((len = GetEnvironmentVariableA("NoEdgeReport", buffer, sizeof buffer)) > 0 && len < sizeof buffer && atoi(buffer) > 0)
+		interval = atoi(buffer);
+	HANDLE handles[2] = { monitorStop, CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS) };
+	LARGE_INTEGER due;
+	due.QuadPart = -10000LL * period;
+	if (handles[1] == NULL || !SetWaitableTimerEx(handles[1], &due, period, NULL, NULL, NULL, ecoMode ? 500 : 0))
+		return 1;
+	while (WaitForMultipleObjects(2, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1) {
+		InterlockedIncrement(&wakeups);
+		drainTrace();
+		sampleHistograms();
+		if ((elapsed += period) >= interval * 1000) {
+			report();
+			elapsed = 0;
+		}
+	}
+	CloseHandle(handles[1]);
+	drainTrace();
+	report();
+	return 0;
+}
+
+/*
+Filter rules, loaded from the binary rule file given in environment variable NoEdgeRules
+(format see KeyFilterParseRules, a timeout of 0 stands for NoEdgeTimeout). The rules will be
+compiled into a rule set for the keyboard hook. If the file does not exist or is invalid, the
+hook uses its default rule (LEFT-WINDOWS only). A relative file name is relative to the
+directory of NoEdge.exe, not to the working directory: The service starts in the system
+directory.
+*/
+static BOOL rulesFile(char *name, DWORD size) {
+	char path[MAX_PATH], *file;
+	DWORD len;
+	if ((len = GetEnvironmentVariableA("NoEdgeRules", name, size)) <= 0 || len >= size)
+		return FALSE;
+	if (name[0] == '\\' || name[0] == '/' || (name[0] != 0 && name[1] == ':'))
+		return TRUE;
+	if ((len = GetModuleFileNameA(NULL, path, sizeof path)) == 0 || len >= sizeof path
+		|| (file = strrchr(path, '\\')) == NULL || (SIZE_T)(file + 1 - path) + strlen(name) >= sizeof path)
+		return FALSE;
+	memcpy(file + 1, name, strlen(name) + 1);
+	len = GetFullPathNameA(path, size, name, NULL);
+	return len > 0 && len < size;
+}
+
+static BOOL loadRules(struct KeyFilterRules *rules) {
+	char name[MAX_PATH];
+	BYTE buffer[8192];
+	DWORD size = 0;
+	if (!rulesFile(name, sizeof name))
+		return FALSE;
+	HANDLE file = CreateFileA(name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return FALSE;
+	BOOL ok = ReadFile(file, buffer, sizeof buffer, &size, NULL);
+	CloseHandle(file);
+	return ok && KeyFilterParseRules(rules, buffer, size);
+}
+
+/*
+Shared configuration for terminal servers. Low level hooks are per desktop, so every interactive
+session still needs its own agent with its own hook. The rule set and configuration need not be
+per session: NoEdge.exe /service runs as a Windows service (e.g. installed by
+sc create NoEdge binPath= "<path>\NoEdge.exe /service"). It loads the rules as usual and publishes
+them, along with its NoEdgeXxx environment variables, in the read-only file mapping
+Global\NoEdgeConfig. An agent started with environment variable NoEdgeShared=1 maps that block
+read-only, passes the rule set in the mapping to the hook and takes all NoEdgeXxx variables it has
+not set itself from the block. All agents map the same physical pages, locking them costs each
+session one working set entry per page only. Variables that must differ per session (NoEdgeLog,
+NoEdgeCapture, NoEdgeCaptureSize, NoEdgeShared, NoEdgeTakeover) will not be published.
+*/
+#define NOEDGE_SHARED_NAME "Global\\NoEdgeConfig"
+#define NOEDGE_SHARED_MAGIC "NESC"
+#define NOEDGE_SHARED_VERSION 1
+
+struct SharedConfig {
+	char Magic[4];					// NOEDGE_SHARED_MAGIC
+	DWORD Version;					// NOEDGE_SHARED_VERSION
+	DWORD Size;						// sizeof(struct SharedConfig)
+	BOOL HasRules;					// Rules valid, otherwise the hook uses its default rule
+	char Environment[4096];			// "NoEdgeXxx=value" strings, terminated by an empty string
+	alignas(64) struct KeyFilterRules Rules;
+};
+
+static HANDLE sharedMapping;
+static const struct SharedConfig *sharedConfig;
+
+static BOOL publishedVariable(const char *variable) {
+	static const char *local[] = { "NoEdgeLog=", "NoEdgeCapture=", "NoEdgeCaptureSize=", "NoEdgeShared=", "NoEdgeTakeover=" };
+	if (memcmp(variable, "NoEdge", 6) != 0)
+		return FALSE;
+	for (int i = 0; i < sizeof local / sizeof *local; i++)
+		if (memcmp(variable, local[i], strlen(local[i])) == 0)
+			return FALSE;
+	return TRUE;
+}
+
+/*
+Creates and fills the shared configuration block, readable by everyone. Used by the service.
+*/
+static BOOL publishConfig() {
+	SECURITY_ATTRIBUTES sa = { sizeof sa, NULL, FALSE };
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorA("D:(A;;GA;;;SY)(A;;GR;;;WD)", SDDL_REVISION_1, &sa.lpSecurityDescriptor, NULL))
+		return FALSE;
+	sharedMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, 0, sizeof(struct SharedConfig), NOEDGE_SHARED_NAME);
+	LocalFree(sa.lpSecurityDescriptor);
+	struct SharedConfig *config;
+	if (sharedMapping == NULL
+		|| (config = (struct SharedConfig*)MapViewOfFile(sharedMapping, FILE_MAP_WRITE, 0, 0, sizeof *config)) == NULL)
+		return FALSE;
+	config->HasRules = loadRules(&config->Rules);
+	char *environment = GetEnvironmentStringsA();
+	SIZE_T pos = 0;
+	for (const char *p = environment; p != NULL && *p != 0; p += strlen(p) + 1) {
+		SIZE_T len = strlen(p) + 1;
+		if (publishedVariable(p) && pos + len < sizeof config->Environment) {
+			memcpy(config->Environment + pos, p, len);
+			pos += len;
+		}
+	}
+	if (environment != NULL)
+		FreeEnvironmentStringsA(environment);
+	config->Environment[pos] = 0;
+	config->Version = NOEDGE_SHARED_VERSION;
+	config->Size = sizeof *config;
+	memcpy(config->Magic, NOEDGE_SHARED_MAGIC, sizeof config->Magic);
+	sharedConfig = config;
+	logPrintf("published %s, %lu rules, %llu bytes of environment", NOEDGE_SHARED_NAME,
+		config->HasRules ? config->Rules.Count : 0, (ULONGLONG)pos);
+	return TRUE;
+}
+
+/*
+Maps the shared configuration block if NoEdgeShared=1 and takes over its environment variables.
+Must be called before any other configuration will be read. Used by the agent.
+*/
+static BOOL attachConfig() {
+	char buffer[4];
+	DWORD len;
+	if ((len = GetEnvironmentVariableA("NoEdgeShared", buffer, sizeof buffer)) <= 0 || len >= sizeof buffer || !equal(buffer, "1"))
+		return FALSE;
+	const struct SharedConfig *config;
+	if ((sharedMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, NOEDGE_SHARED_NAME)) == NULL
+		|| (config = (const struct SharedConfig*)MapViewOfFile(sharedMapping, FILE_MAP_READ, 0, 0, sizeof *config)) == NULL) {
+		logPrintf("cannot open %s, error %lu, using local configuration", NOEDGE_SHARED_NAME, GetLastError());
+		return FALSE;
+	}
+	if (memcmp(config->Magic, NOEDGE_SHARED_MAGIC, sizeof config->Magic) != 0 || config->Version != NOEDGE_SHARED_VERSION
+		|| config->Size != sizeof *config) {
+		logPrintf("%s has an unknown format, using local configuration", NOEDGE_SHARED_NAME);
+		UnmapViewOfFile(config);
+		return FALSE;
+	}
+	char name[64];
+	for (const char *p = config->Environment; p < config->Environment + sizeof config->Environment && *p != 0; p += strlen(p) + 1) {
+		const char *value = strchr(p, '=');
+		if (value != NULL && value - p < sizeof name) {
+			memcpy(name, p, value - p);
+			name[value - p] = 0;
+			if (GetEnvironmentVariableA(name, NULL, 0) == 0)
+				SetEnvironmentVariableA(name, value + 1);
+		}
+	}
+	sharedConfig = config;
+	return TRUE;
+}
+
+/*
+Per host status next to the shared configuration, in the file mapping Global\NoEdgeStatus created
+by the service: Each shared agent claims one slot for its process, session, number of installed
+keyboard hooks and bytes locked into its working set, and frees it when it exits. The service
+frees the slots of agents that have died and sums up all slots into the header every NoEdgeReport
+seconds (default 600). Interactive users may write the status but not Global\NoEdgeConfig: An agent
+must not be able to change the configuration of other sessions.
+*/
+#define NOEDGE_STATUS_NAME "Global\\NoEdgeStatus"
+#define NOEDGE_STATUS_MAGIC "NEST"
+#define NOEDGE_STATUS_VERSION 1
+#define NOEDGE_STATUS_SLOTS 64
+
+struct AgentStatus {
+	LONG volatile ProcessId;		// Agent process, 0 for a free slot
+	DWORD SessionId;				// Session of the agent
+	DWORD Hooks;					// Installed keyboard hooks
+	DWORD Reserved;
+	ULONGLONG LockedBytes;			// Bytes locked into the working set of the agent
+};
+
+struct SharedStatus {
+	char Magic[4];					// NOEDGE_STATUS_MAGIC
+	DWORD Version;					// NOEDGE_STATUS_VERSION
+	DWORD Size;						// sizeof(struct SharedStatus)
+	DWORD Agents;					// Slots in use at the last report of the service
+	DWORD Hooks;					// Sum of all installed hooks at the last report
+	DWORD Reserved;
+	ULONGLONG LockedBytes;			// Sum of all locked bytes at the last report
+	struct AgentStatus Agent[NOEDGE_STATUS_SLOTS];
+};
+
+static HANDLE statusMapping;
+static struct SharedStatus *sharedStatus;
+static struct AgentStatus *agentStatus;
+
+/*
+Creates the status block. Used by the service.
+*/
+static BOOL publishStatus() {
+	SECURITY_ATTRIBUTES sa = { sizeof sa, NULL, FALSE };
+	if (!ConvertStringSecurityDescriptorToSecurityDescriptorA("D:(A;;GA;;;SY)(A;;GRGW;;;IU)(A;;GR;;;WD)", SDDL_REVISION_1, &sa.lpSecurityDescriptor, NULL))
+		return FALSE;
+	statusMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, 0, sizeof(struct SharedStatus), NOEDGE_STATUS_NAME);
+	LocalFree(sa.lpSecurityDescriptor);
+	if (statusMapping == NULL
+		|| (sharedStatus = (struct SharedStatus*)MapViewOfFile(statusMapping, FILE_MAP_WRITE, 0, 0, sizeof *sharedStatus)) == NULL)
+		return FALSE;
+	sharedStatus->Version = NOEDGE_STATUS_VERSION;
+	sharedStatus->Size = sizeof *sharedStatus;
+	memcpy(sharedStatus->Magic, NOEDGE_STATUS_MAGIC, sizeof sharedStatus->Magic);
+	return TRUE;
+}
+
+/*
+Frees the slots of agents that have exited, sums up the others and logs the sums. Used by the service.
+*/
+static void reportStatus() {
+	DWORD agents = 0, hooks = 0;
+	ULONGLONG locked = 0;
+	for (int i = 0; i < NOEDGE_STATUS_SLOTS; i++) {
+		struct AgentStatus *agent = &sharedStatus->Agent[i];
+		LONG pid = ReadAcquire(&agent->ProcessId);
+		if (pid == 0)
+			continue;
+		HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+		BOOL alive = process != NULL && WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+		if (process != NULL)
+			CloseHandle(process);
+		if (!alive) {
+			InterlockedCompareExchange(&agent->ProcessId, 0, pid);
+			continue;
+		}
+		agents++;
+		hooks += agent->Hooks;
+		locked += agent->LockedBytes;
+	}
+	sharedStatus->Agents = agents;
+	sharedStatus->Hooks = hooks;
+	sharedStatus->LockedBytes = locked;
+	logPrintf("%s: %lu agents, %lu keyboard hooks installed, %llu bytes locked", NOEDGE_STATUS_NAME, agents, hooks, locked);
+}
+
+/*
+Claims a slot of the status block and fills it. Used by shared agents once the hook is installed,
+without status block (service of an older version) there is no status.
+*/
+static void attachStatus(DWORD hooks) {
+	LONG pid = (LONG)GetCurrentProcessId();
+	if ((statusMapping = OpenFileMappingA(FILE_MAP_WRITE, FALSE, NOEDGE_STATUS_NAME)) == NULL
+		|| (sharedStatus = (struct SharedStatus*)MapViewOfFile(statusMapping, FILE_MAP_WRITE, 0, 0, sizeof *sharedStatus)) == NULL
+		|| memcmp(sharedStatus->Magic, NOEDGE_STATUS_MAGIC, sizeof sharedStatus->Magic) != 0 || sharedStatus->Version != NOEDGE_STATUS_VERSION) {
+		logPrintf("cannot open %s, error %lu, no status", NOEDGE_STATUS_NAME, GetLastError());
+		return;
+	}
+	for (int i = 0; i < NOEDGE_STATUS_SLOTS && agentStatus == NULL; i++) {
+		if (InterlockedCompareExchange(&sharedStatus->Agent[i].ProcessId, pid, 0) == 0)
+			agentStatus = &sharedStatus->Agent[i];
+	}
+	if (agentStatus == NULL) {
+		logPrintf("%s is full, no status", NOEDGE_STATUS_NAME);
+		return;
+	}
+	ProcessIdToSessionId(GetCurrentProcessId(), &agentStatus->SessionId);
+	agentStatus->Hooks = hooks;
+	agentStatus->LockedBytes = lockedBytes;
+}
+
+static void detachStatus() {
+	if (agentStatus != NULL) {
+		agentStatus->Hooks = 0;
+		WriteRelease(&agentStatus->ProcessId, 0);
+		agentStatus = NULL;
+	}
+}
+
+/*
+Capture mode. If environment variable NoEdgeCapture specifies a file name, the keyboard hook
+writes all key events into that file, a memory mapped key trace ring as read by NoEdgeBench
+(see KeyTraceHeader). Environment variable NoEdgeCaptureSize specifies the number of records,
+default 65536, rounded down to a power of two (256 - 131072, at most 4 MB). An existing file will be
+overwritten. Only the header with the write position is locked into the working set, the records
+are touched once when the file is created but not locked: A capture must not pin megabytes.
+*/
+#define NOEDGE_CAPTURE_MAX (1 << 17)
+
+static HANDLE captureFile = INVALID_HANDLE_VALUE, captureMapping;
+static struct KeyTraceHeader *capture;
+
+static void closeCapture() {
+	if (capture != NULL) {
+		FlushViewOfFile(capture, 0);
+		UnmapViewOfFile(capture);
+		capture = NULL;
+	}
+	if (captureMapping != NULL) {
+		CloseHandle(captureMapping);
+		captureMapping = NULL;
+	}
+	if (captureFile != INVALID_HANDLE_VALUE) {
+		CloseHandle(captureFile);
+		captureFile = INVALID_HANDLE_VALUE;
+	}
+}
+
+static struct KeyTraceHeader *openCapture() {
+	char name[MAX_PATH];
+	DWORD len, capacity = 65536, size;
+	if ((len = GetEnvironmentVariableA("NoEdgeCapture", name, sizeof name)) <= 0 || len >= sizeof name)
+		return NULL;
+	char buffer[20];
+	if ((len = GetEnvironmentVariableA("NoEdgeCaptureSize", buffer, sizeof buffer)) > 0 && len < sizeof buffer && atoi(buffer) >= 256) {
+		size = atoi(buffer) < NOEDGE_CAPTURE_MAX ? atoi(buffer) : NOEDGE_CAPTURE_MAX;
+		for (capacity = 256; capacity * 2 <= size; capacity *= 2)
+			;
+	}
+	size = sizeof *capture + capacity * sizeof(struct KeyTraceRecord);
+	captureFile = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (captureFile == INVALID_HANDLE_VALUE)
+		return NULL;
+	if ((captureMapping = CreateFileMappingA(captureFile, NULL, PAGE_READWRITE, 0, size, NULL)) != NULL
+		&& (capture = (struct KeyTraceHeader*)MapViewOfFile(captureMapping, FILE_MAP_WRITE, 0, 0, size)) != NULL) {
+		// Touch all pages now, the hook shall not wait for page faults of a fresh file.
+		memset(capture, 0, size);
+		lockMemory(capture, sizeof *capture);
+		memcpy(capture->Magic, NOEDGE_TRACE_MAGIC, sizeof capture->Magic);
+		capture->Version = NOEDGE_TRACE_VERSION;
+		capture->RecordSize = sizeof(struct KeyTraceRecord);
+		capture->Capacity = capacity;
+		logPrintf("capturing key events to %s, %lu records", name, capacity);
+		return capture;
+	}
+	closeCapture();
+	return NULL;
+}
+
+/*
+Live counters for monitoring agents: The hook writes its counters (see HookCounters) directly into
+the file mapping Local\NoEdgeCounters.<process id>, the process id of the running instance is
+published in Local\NoEdgeInstance. An agent maps the block read-only and polls it, the hook never
+waits for a reader.
+*/
+static HANDLE countersMapping;
+static struct HookCounters *counters;
+
+static struct HookCounters *openCounters() {
+	char name[64];
+	sprintf_s(name, sizeof name, "Local\\NoEdgeCounters.%lu", GetCurrentProcessId());
+	if ((countersMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof *counters, name)) == NULL
+		|| (counters = (struct HookCounters*)MapViewOfFile(countersMapping, FILE_MAP_WRITE, 0, 0, sizeof *counters)) == NULL) {
+		logPrintf("cannot create %s, error %lu", name, GetLastError());
+		return NULL;
+	}
+	memset(counters, 0, sizeof *counters);
+	lockMemory(counters, sizeof *counters);
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	counters->Frequency = frequency.QuadPart;
+	counters->ProcessId = GetCurrentProcessId();
+	counters->Version = NOEDGE_COUNTERS_VERSION;
+	memcpy(counters->Magic, NOEDGE_COUNTERS_MAGIC, sizeof counters->Magic);
+	logPrintf("live counters in %s", name);
+	return counters;
+}
+
+static void closeCounters() {
+	if (counters != NULL) {
+		UnmapViewOfFile(counters);
+		counters = NULL;
+	}
+	if (countersMapping != NULL) {
+		CloseHandle(countersMapping);
+		countersMapping = NULL;
+	}
+}
+
+/*
+Startup profile: QueryPerformanceCounter timestamps at the end of each startup phase, from
+entering myMain up to the first message processed by the message loop. The profile will be
+written to the log at exit and whenever the main thread receives WM_NOEDGE_REPORT (e.g. via
+PostThreadMessage from another process, the thread id will be logged at startup).
+ProcessStart is the time from process creation to entering myMain in milliseconds.
+*/
+#define WM_NOEDGE_REPORT (WM_APP + 2)
+
+enum StartupPhase {
+	StartupMain,					// myMain entered
+	StartupPriority,				// Priority setup
+	StartupLoad,					// LoadLibrary
+	StartupResolve,					// GetNoEdgeFunctions resolution
+	StartupInit,					// Init of the hook dll
+	StartupLock,					// VirtualLock of image sections
+	StartupSetup,					// Rules, capture file and timer worker
+	StartupHook,					// SetWindowsHookExA
+	StartupTakeover,				// Takeover from a running instance, see takeOverInstance
+	StartupFirstMessage,			// First message processed
+	StartupPhases
+};
+
+static struct {
+	double ProcessStart;
+	LONGLONG Time[StartupPhases];
+} startup;
+
+static void startupPhase(enum StartupPhase phase) {
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	startup.Time[phase] = now.QuadPart;
+}
+
+static void reportStartup() {
+	static const char *names[StartupPhases] = { "main", "priority", "LoadLibrary", "GetNoEdgeFunctions", "Init",
+		"VirtualLock", "setup", "SetWindowsHookExA", "takeover", "first message" };
+	char buffer[512];
+	LARGE_INTEGER frequency;
+	int len = sprintf_s(buffer, sizeof buffer, "startup: process start to main %.1f ms", startup.ProcessStart);
+	QueryPerformanceFrequency(&frequency);
+	for (int i = StartupPriority; i < StartupPhases && startup.Time[i] != 0 && len > 0; i++)
+		len += sprintf_s(buffer + len, sizeof buffer - len, ", %s %.3f ms", names[i],
+			(startup.Time[i] - startup.Time[i - 1]) * 1000.0 / frequency.QuadPart);
+	logPrintf("%s", buffer);
+}
+
+/*
+The keyboard hook. Windows removes a low level hook silently if it exceeds LowLevelHooksTimeout.
+The hook will be reinstalled when the message loop receives WM_NOEDGE_REHOOK, which must be
+handled by the thread that installed the hook.
+A newly installed hook is the first of the chain. Other low level hooks installed later (IMEs,
+remote desktop and macro tools) run before it and add their time to every key event. With
+environment variable NoEdgeRehook (seconds), the hook will be reinstalled periodically to stay
+first. The new hook will be installed before the old one will be removed: No key event can pass
+unfiltered in between, and none reaches the hook procedure twice, since both hooks belong to
+this thread, which does not process any event between the two calls.
+*/
+#define WM_NOEDGE_REHOOK (WM_APP + 1)
+
+static HOOKPROC hookProc;
+static HINSTANCE hookModule;
+static HHOOK hookHandle;
+static HANDLE rehookTimer;
+
+/*
+Installs the hook, replacing the installed one if any. Counts every replacement, whether
+periodic or requested by WM_NOEDGE_REHOOK, in chainRehooks.
+*/
+static BOOL installHook() {
+	HHOOK hook = SetWindowsHookExA(WH_KEYBOARD_LL, hookProc, hookModule, 0);
+	if (hook == NULL)
+		return FALSE;
+	if (hookHandle != NULL) {
+		UnhookWindowsHookEx(hookHandle);
+		InterlockedIncrement(&chainRehooks);
+	}
+	hookHandle = hook;
+	return TRUE;
+}
+
+static void rehook() {
+	if (!installHook())
+		errorExit("Cannot reinstall keyboard hook", 3);
+}
+
+static void startRehook() {
+	char buffer[20];
+	int len;
+	if ((len = GetEnvironmentVariableA("NoEdgeRehook", buffer, sizeof buffer)) <= 0 || len >= sizeof buffer || atoi(buffer) <= 0)
+		return;
+	LARGE_INTEGER due;
+	LONG period = atoi(buffer) * 1000;
+	due.QuadPart = -10000LL * period;
+	if ((rehookTimer = CreateWaitableTimerExW(NULL, NULL, 0, TIMER_ALL_ACCESS)) == NULL
+		|| !SetWaitableTimerEx(rehookTimer, &due, period, NULL, NULL, NULL, 1000)) {
+		logPrintf("cannot start periodic hook reinstallation, error %lu", GetLastError());
+		if (rehookTimer != NULL)
+			CloseHandle(rehookTimer);
+		rehookTimer = NULL;
+		return;
+	}
+	logPrintf("keyboard hook will be reinstalled every %d seconds", atoi(buffer));
+}
+
+/*
+Single instance per session. The instance that owns mutex Local\NoEdge publishes its process and
+main thread id in the file mapping Local\NoEdgeInstance. A further instance exits at once, unless
+environment variable NoEdgeTakeover=1 is set (e.g. by an upgrade): Then it sets up and installs
+its own hook first and asks the running instance to quit via WM_NOEDGE_QUIT to its main thread.
+The old instance removes its hook and exits, the new one takes over the mutex. Until then both
+hooks are installed, the new one is called first and its replays pass the old one (see
+NOEDGE_EXTRA_INFO), so key events are never unfiltered. The new instance pumps messages and
+handles its timer while it waits for the mutex: Its hook is serviced all the time, neither the
+keyboard input of the session nor the old instance behind it stall.
+*/
+#define WM_NOEDGE_QUIT (WM_APP + 3)
+#define NOEDGE_TAKEOVER_WAIT 5000
+
+struct InstanceInfo {
+	DWORD ProcessId;
+	DWORD ThreadId;
+};
+
+static HANDLE instanceMutex, instanceMapping;
+static struct InstanceInfo *instance;
+
+/*
+Returns TRUE if this instance owns the mutex, FALSE if it has to take over from a running
+instance. Exits if another instance is running and takeover has not been requested.
+*/
+static BOOL claimInstance() {
+	char buffer[4];
+	DWORD len;
+	if ((instanceMutex = CreateMutexA(NULL, TRUE, "Local\\NoEdge")) == NULL)
+		errorExit("Cannot create instance mutex", 6);
+	BOOL owner = GetLastError() != ERROR_ALREADY_EXISTS;
+	if ((instanceMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof *instance, "Local\\NoEdgeInstance")) == NULL
+		|| (instance = (struct InstanceInfo*)MapViewOfFile(instanceMapping, FILE_MAP_WRITE, 0, 0, sizeof *instance)) == NULL)
+		errorExit("Cannot create instance information", 6);
+	if (!owner && ((len = GetEnvironmentVariableA("NoEdgeTakeover", buffer, sizeof buffer)) <= 0 || len >= sizeof buffer || !equal(buffer, "1"))) {
+		logPrintf("instance %lu is running already, exiting", instance->ProcessId);
+		errorExit("Another instance is running", 6);
+	}
+	return owner;
+}
+
+/*
+Makes this instance the running one once its hook is installed: Asks the previous instance to
+quit if necessary, waits for the mutex and publishes the ids of this instance. Timer and
+messages are handled as in messageLoop while waiting, a quit request is kept for messageLoop.
+*/
+static void takeOverInstance(BOOL owner, void(*setTimerTick)(DWORD), HANDLE timer, void(*timerFired)()) {
+	if (!owner) {
+		DWORD process = instance->ProcessId, ret = WAIT_TIMEOUT, count = 1;
+		HANDLE handles[2] = { instanceMutex, timer };
+		ULONGLONG deadline = GetTickCount64() + NOEDGE_TAKEOVER_WAIT, now;
+		BOOL quit = FALSE;
+		if (timer != NULL)
+			count++;
+		PostThreadMessageA(instance->ThreadId, WM_NOEDGE_QUIT, 0, 0);
+		while ((now = GetTickCount64()) < deadline) {
+			ret = MsgWaitForMultipleObjects(count, handles, FALSE, (DWORD)(deadline - now), QS_ALLINPUT);
+			if (ret == WAIT_OBJECT_0 + count) {
+				MSG msg;
+				while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+					if (msg.message == WM_QUIT || msg.message == WM_NOEDGE_QUIT)
+						quit = TRUE;
+					else if (msg.message == WM_NOEDGE_REHOOK)
+						rehook();
+					else {
+						if (msg.message == WM_TIMER)
+							setTimerTick(msg.time);
+						TranslateMessage(&msg);
+						DispatchMessage(&msg);
+					}
+				}
+			}
+			else if (ret == WAIT_OBJECT_0 + 1 && timer != NULL)
+				timerFired();
+			else
+				break;
+		}
+		if (quit)
+			PostThreadMessageA(GetCurrentThreadId(), WM_NOEDGE_QUIT, 0, 0);
+		if (ret == WAIT_OBJECT_0 || ret == WAIT_ABANDONED_0)
+			logPrintf("took over from instance %lu", process);
+		else
+			logPrintf("instance %lu did not quit within %d ms, running in parallel", process, NOEDGE_TAKEOVER_WAIT);
+	}
+	instance->ProcessId = GetCurrentProcessId();
+	instance->ThreadId = GetCurrentThreadId();
+}
+
+/*
+Leaves the running instance: Removes the hook at once and hands the mutex to a waiting instance.
+*/
+static void releaseInstance() {
+	if (hookHandle != NULL) {
+		UnhookWindowsHookEx(hookHandle);
+		hookHandle = NULL;
+	}
+	ReleaseMutex(instanceMutex);
+}
+
+/*
+The watchdog thread, enabled by environment variable NoEdgeWatchdog (stall threshold in
+milliseconds). It samples the heartbeat of the hook twice per threshold period and
+- reports every hook invocation running longer than the threshold, measured from its entry,
+- checks the residency of the locked pages (see lockMemory) while the hook is active: A locked
+page that is not in the working set would make the hook thread fault, hard if the page has left
+memory. The process page fault count can't tell, it includes soft faults of all threads.
+- requests reinstallation of the hook if an invocation exceeds LowLevelHooksTimeout: The
+system will have removed the hook in that case.
+*/
+static HANDLE watchdogStop;
+static DWORD mainThread;
+static const struct HookHeartbeat *heartbeat;
+
+static DWORD lowLevelHooksTimeout() {
+	DWORD value = 0, size = sizeof value;
+	if (RegGetValueA(HKEY_CURRENT_USER, "Control Panel\\Desktop", "LowLevelHooksTimeout", RRF_RT_REG_DWORD, NULL, &value, &size) != ERROR_SUCCESS || value == 0)
+		value = 300;
+	return value > 1000 ? 1000 : value;
+}
+
+/*
+Returns the list of all locked pages for QueryWorkingSetEx, NULL if there are none.
+*/
+static PSAPI_WORKING_SET_EX_INFORMATION *lockedPages(DWORD *count) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	*count = (DWORD)(lockedBytes / info.dwPageSize);
+	PSAPI_WORKING_SET_EX_INFORMATION *pages;
+	if (*count == 0 || (pages = (PSAPI_WORKING_SET_EX_INFORMATION*)calloc(*count, sizeof *pages)) == NULL)
+		return NULL;
+	DWORD n = 0;
+	for (int i = 0; i < lockedCount; i++)
+		for (SIZE_T offset = 0; offset < lockedRanges[i].Size && n < *count; offset += info.dwPageSize)
+			pages[n++].VirtualAddress = lockedRanges[i].Address + offset;
+	*count = n;
+	return pages;
+}
+
+/*
+Returns the number of locked pages that are not resident.
+*/
+static DWORD nonresidentPages(PSAPI_WORKING_SET_EX_INFORMATION *pages, DWORD count) {
+	DWORD missing = 0;
+	if (pages != NULL && QueryWorkingSetEx(GetCurrentProcess(), pages, count * sizeof *pages)) {
+		for (DWORD i = 0; i < count; i++)
+			if (!pages[i].VirtualAttributes.Valid)
+				missing++;
+	}
+	return missing;
+}
+
+static DWORD WINAPI watchdog(LPVOID threshold) {
+	DWORD limit = (DWORD)(SIZE_T)threshold, timeout = lowLevelHooksTimeout(), stalls = 0, rehooks = 0;
+	DWORD interval = limit / 2 > 5 ? limit / 2 : 5, exposed = 0, worst = 0, npages;
+	LONG last = ReadAcquire(&heartbeat->Count), stalled = 0, rehooked = 0;
+	PSAPI_WORKING_SET_EX_INFORMATION *pages = lockedPages(&npages);
+	while (WaitForSingleObject(watchdogStop, interval) == WAIT_TIMEOUT) {
+		InterlockedIncrement(&wakeups);
+		LONG count = ReadAcquire(&heartbeat->Count);
+		DWORD entry = heartbeat->Entry, missing;
+		if ((count != last || (count & 1)) && (missing = nonresidentPages(pages, npages)) > 0) {
+			exposed++;
+			if (missing > worst)
+				worst = missing;
+		}
+		last = count;
+		if (count & 1) {
+			DWORD elapsed = GetTickCount() - entry;
+			if (elapsed >= limit && count != stalled) {
+				stalled = count;
+				stalls++;
+				logPrintf("hook stall: invocation running for %lu ms", elapsed);
+			}
+			if (elapsed >= timeout && count != rehooked) {
+				rehooked = count;
+				rehooks++;
+				logPrintf("hook exceeded LowLevelHooksTimeout (%lu ms), reinstalling", timeout);
+				PostThreadMessage(mainThread, WM_NOEDGE_REHOOK, 0, 0);
+			}
+		}
+	}
+	logPrintf("watchdog: %lu stalls above %lu ms, %lu samples during hook activity with locked pages not resident (up to %lu of %lu), %lu reinstallations",
+		stalls, limit, exposed, worst, npages, rehooks);
+	free(pages);
+	return 0;
+}
+
+/*
+Early release of real keyboard presses, enabled by environment variable NoEdgeRawInput (non-zero).
+The decision can't come from the raw input of the key press itself: Raw input is generated after
+the low level hooks, and a key event discarded by the hook, as the buffered trigger key press is,
+never shows up as WM_INPUT. So the hook decides when the key press arrives, by the touch pad
+gate (see below) with the whole touch pad as edge: A trigger key press without any touch pad
+contact within NoEdgeGate milliseconds (default NOEDGE_RELEASE_WINDOW) cannot be part of an edge
+swipe and passes at once, everything else waits for the timeout as usual.
+*/
+#define MAX_TOUCHPADS 8
+#define NOEDGE_RELEASE_WINDOW 1000
+
+static HWND rawInputWindow;
+
+/*
+Touch pad gate, enabled by environment variable NoEdgeGate (window in milliseconds, non-zero).
+The hook arms its filter only within that window after a touch pad contact at the left, upper
+or right edge (NoEdgeGateEdge percent of width or height, default 5, 50 with NoEdgeRawInput: any
+contact), see SetGateWindow. Edge
+contacts will be read from the raw input of all precision touch pads: Each contact of a report
+is a link collection with tip switch (HID usage page 0x0D, usage 0x42) and X/Y (usage page 0x01,
+usages 0x30/0x31). An edge swipe starts with a contact at the edge and the touch pad sends its
+key sequence only after the finger has travelled onto the touch pad, so the gate is open by
+then. If any touch pad cannot be parsed, the gate will be disabled and the filter stays armed.
+*/
+#define MAX_TOUCHPAD_CONTACTS 10
+
+struct TouchpadContact {
+	USHORT Link;					// Link collection of the contact
+	LONG XMin, XMax, YMin, YMax;	// Logical range of X and Y
+};
+
+struct Touchpad {
+	HANDLE Device;
+	PHIDP_PREPARSED_DATA Preparsed;
+	int Contacts;
+	struct TouchpadContact Contact[MAX_TOUCHPAD_CONTACTS];
+};
+
+static DWORD gateWindow, gateEdge = 5;
+static struct Touchpad touchpadDevices[MAX_TOUCHPADS];
+static int touchpadDeviceCount;
+static void(*SetGateWindow)(DWORD);
+static void(*OpenGate)(DWORD);
+
+static BOOL parseTouchpad(struct Touchpad *pad) {
+	HIDP_VALUE_CAPS x[MAX_TOUCHPAD_CONTACTS], y[MAX_TOUCHPAD_CONTACTS];
+	USHORT xcount = MAX_TOUCHPAD_CONTACTS, ycount = MAX_TOUCHPAD_CONTACTS;
+	UINT size = 0;
+	pad->Contacts = 0;
+	if (GetRawInputDeviceInfoA(pad->Device, RIDI_PREPARSEDDATA, NULL, &size) != 0 || size == 0
+		|| (pad->Preparsed = (PHIDP_PREPARSED_DATA)malloc(size)) == NULL)
+		return FALSE;
+	if (GetRawInputDeviceInfoA(pad->Device, RIDI_PREPARSEDDATA, pad->Preparsed, &size) == (UINT)-1
+		|| HidP_GetSpecificValueCaps(HidP_Input, HID_USAGE_PAGE_GENERIC, 0, HID_USAGE_GENERIC_X, x, &xcount, pad->Preparsed) != HIDP_STATUS_SUCCESS
+		|| HidP_GetSpecificValueCaps(HidP_Input, HID_USAGE_PAGE_GENERIC, 0, HID_USAGE_GENERIC_Y, y, &ycount, pad->Preparsed) != HIDP_STATUS_SUCCESS)
+		return FALSE;
+	for (USHORT i = 0; i < xcount; i++) {
+		for (USHORT j = 0; j < ycount; j++) {
+			if (x[i].LinkCollection == y[j].LinkCollection && x[i].LogicalMax > x[i].LogicalMin && y[j].LogicalMax > y[j].LogicalMin) {
+				struct TouchpadContact *contact = &pad->Contact[pad->Contacts++];
+				contact->Link = x[i].LinkCollection;
+				contact->XMin = x[i].LogicalMin;
+				contact->XMax = x[i].LogicalMax;
+				contact->YMin = y[j].LogicalMin;
+				contact->YMax = y[j].LogicalMax;
+				break;
+			}
+		}
+	}
+	return pad->Contacts > 0;
+}
+
+static void findTouchpads() {
+	RAWINPUTDEVICELIST list[64];
+	UINT count = sizeof list / sizeof *list, size;
+	BOOL parsed = TRUE;
+	int contacts = 0;
+	for (int i = 0; i < touchpadDeviceCount; i++)
+		free(touchpadDevices[i].Preparsed);
+	touchpadDeviceCount = 0;
+	if ((count = GetRawInputDeviceList(list, &count, sizeof *list)) == (UINT)-1)
+		count = 0, parsed = FALSE;
+	for (UINT i = 0; i < count; i++) {
+		RID_DEVICE_INFO info;
+		info.cbSize = size = sizeof info;
+		if (list[i].dwType != RIM_TYPEHID || GetRawInputDeviceInfoA(list[i].hDevice, RIDI_DEVICEINFO, &info, &size) == (UINT)-1
+			|| info.hid.usUsagePage != 0x0d || info.hid.usUsage != 0x05)
+			continue;
+		if (touchpadDeviceCount == MAX_TOUCHPADS) {
+			parsed = FALSE;
+			break;
+		}
+		struct Touchpad *pad = &touchpadDevices[touchpadDeviceCount++];
+		pad->Device = list[i].hDevice;
+		pad->Preparsed = NULL;
+		if (!parseTouchpad(pad))
+			parsed = FALSE;
+		contacts += pad->Contacts;
+	}
+	SetGateWindow(parsed ? gateWindow : 0);
+	if (parsed)
+		logPrintf("touch pad gate: %d touch pads, %d contacts, window %lu ms, edge %lu %%", touchpadDeviceCount, contacts, gateWindow, gateEdge);
+	else
+		logPrintf("touch pad gate disabled, cannot parse all touch pads");
+}
+
+static BOOL edgeContact(const struct Touchpad *pad, const struct TouchpadContact *contact, const BYTE *report, ULONG length) {
+	USAGE usages[16];
+	ULONG count = sizeof usages / sizeof *usages, x, y;
+	BOOL tip = FALSE;
+	if (HidP_GetUsages(HidP_Input, HID_USAGE_PAGE_DIGITIZER, contact->Link, usages, &count, pad->Preparsed, (PCHAR)report, length) != HIDP_STATUS_SUCCESS)
+		return FALSE;
+	for (ULONG i = 0; i < count && !tip; i++)
+		tip = usages[i] == HID_USAGE_DIGITIZER_TIP_SWITCH;
+	if (!tip
+		|| HidP_GetUsageValue(HidP_Input, HID_USAGE_PAGE_GENERIC, contact->Link, HID_USAGE_GENERIC_X, &x, pad->Preparsed, (PCHAR)report, length) != HIDP_STATUS_SUCCESS
+		|| HidP_GetUsageValue(HidP_Input, HID_USAGE_PAGE_GENERIC, contact->Link, HID_USAGE_GENERIC_Y, &y, pad->Preparsed, (PCHAR)report, length) != HIDP_STATUS_SUCCESS)
+		return FALSE;
+	LONG xmargin = (LONG)((LONGLONG)(contact->XMax - contact->XMin) * gateEdge / 100);
+	LONG ymargin = (LONG)((LONGLONG)(contact->YMax - contact->YMin) * gateEdge / 100);
+	return (LONG)x <= contact->XMin + xmargin || (LONG)x >= contact->XMax - xmargin || (LONG)y <= contact->YMin + ymargin;
+}
+
+/*
+Handles the raw input of a touch pad: Opens the gate if any contact of any report is at an edge.
+*/
+static void touchpadInput(const RAWINPUT *input, DWORD time) {
+	for (int i = 0; i < touchpadDeviceCount; i++) {
+		const struct Touchpad *pad = &touchpadDevices[i];
+		if (pad->Device != input->header.hDevice)
+			continue;
+		const BYTE *report = input->data.hid.bRawData;
+		for (DWORD r = 0; r < input->data.hid.dwCount; r++, report += input->data.hid.dwSizeHid) {
+			for (int c = 0; c < pad->Contacts; c++) {
+				if (edgeContact(pad, &pad->Contact[c], report, input->data.hid.dwSizeHid)) {
+					OpenGate(time);
+					return;
+				}
+			}
+		}
+		return;
+	}
+}
+
+/*
+Registers for the raw input of touch pads (NoEdgeGate, NoEdgeRawInput).
+*/
+static BOOL startRawInput() {
+	char buffer[20];
+	int len;
+	if ((len = GetEnvironmentVariableA("NoEdgeGate", buffer, sizeof buffer)) > 0 && len < sizeof buffer && atoi(buffer) > 0)
+		gateWindow = atoi(buffer);
+	if ((len = GetEnvironmentVariableA("NoEdgeGateEdge", buffer, sizeof buffer)) > 0 && len < sizeof buffer && atoi(buffer) > 0 && atoi(buffer) < 50)
+		gateEdge = atoi(buffer);
+	if ((len = GetEnvironmentVariableA("NoEdgeRawInput", buffer, sizeof buffer)) > 0 && len < sizeof buffer && atoi(buffer) != 0) {
+		if (gateWindow == 0)
+			gateWindow = NOEDGE_RELEASE_WINDOW;
+		gateEdge = 50;
+	}
+	if (gateWindow == 0)
+		return FALSE;
+	if ((rawInputWindow = CreateWindowExA(0, "Message", NULL, 0, 0, 0, 0, 0, HWND_MESSAGE, NULL, NULL, NULL)) == NULL)
+		return FALSE;
+	RAWINPUTDEVICE device = { 0x0d, 0x05, RIDEV_INPUTSINK | RIDEV_DEVNOTIFY, rawInputWindow };
+	if (!RegisterRawInputDevices(&device, 1, sizeof device)) {
+		logPrintf("cannot register for raw input, error %lu", GetLastError());
+		DestroyWindow(rawInputWindow);
+		rawInputWindow = NULL;
+		gateWindow = 0;
+		return FALSE;
+	}
+	findTouchpads();
+	return TRUE;
+}
+
+static void rawInputDeviceChange() {
+	if (gateWindow != 0)
+		findTouchpads();
+}
+
+/*
+Handles WM_INPUT: Passes touch pad input to touchpadInput.
+*/
+static void rawInput(HRAWINPUT handle, DWORD time) {
+	static union {
+		RAWINPUT Input;
+		BYTE Buffer[1024];
+	} raw;
+	const RAWINPUT *input = &raw.Input;
+	UINT size = sizeof raw;
+	if (GetRawInputData(handle, RID_INPUT, &raw, &size, sizeof input->header) == (UINT)-1)
+		return;
+	if (input->header.dwType == RIM_TYPEHID)
+		touchpadInput(input, time);
+}
+
+/*
+Priority of process and hook thread: "high", "abovenormal", "belownormal", "idle" or normal
+for anything else.
+*/
+static void setPriority(const char *priority) {
+	DWORD pprio = NORMAL_PRIORITY_CLASS;
+	DWORD tprio = THREAD_PRIORITY_NORMAL;
+	if (equal(priority, "high")) {
+		pprio = HIGH_PRIORITY_CLASS;
+		tprio = THREAD_PRIORITY_HIGHEST;
+	}
+	else if (equal(priority, "abovenormal")) {
+		pprio = ABOVE_NORMAL_PRIORITY_CLASS;
+		tprio = THREAD_PRIORITY_ABOVE_NORMAL;
+	}
+	else if (equal(priority, "belownormal")) {
+		pprio = BELOW_NORMAL_PRIORITY_CLASS;
+		tprio = THREAD_PRIORITY_BELOW_NORMAL;
+	} else if (equal(priority, "idle")) {
+		pprio = IDLE_PRIORITY_CLASS;
+		tprio = THREAD_PRIORITY_IDLE;
+	}
+	if (GetPriorityClass(GetCurrentProcess()) != pprio || GetThreadPriority(GetCurrentThread()) != tprio) {
+		// Put process into given priority class and select matching thread priority to ensure
+		// expected hook processing.
+		SetPriorityClass(GetCurrentProcess(), pprio);
+		SetThreadPriority(GetCurrentThread(), tprio);
+	}
+}
+
+/*
+Live reconfiguration. The values of registry key HKEY_CURRENT_USER\Software\NoEdge, if the key
+exists at startup, override the environment:
+- Timeout (REG_DWORD): Default timeout in milliseconds, as NoEdgeTimeout,
+- Priority (REG_SZ): Priority of process and hook thread, as NoEdgePriority.
+The message loop waits for changes of that key and of the directory of the rule file
+(NoEdgeRules). On a change, it compiles a new rule set with the default timeout into the rule
+buffer not in use and passes it to the hook. SetRules is a single pointer swap on the hook
+thread, the hook keeps running without lock, reinstallation or new locked pages. A rule file
+that cannot be read (e.g. while being written) keeps the rule set in use. Not available with
+the shared configuration, which belongs to the service.
+*/
+static struct KeyFilterRules ruleSets[2];
+static int currentRules;
+static HKEY configKey;
+static HANDLE configChange, rulesChange;
+static WIN32_FILE_ATTRIBUTE_DATA rulesStamp;	// Rule file last write time and size, see rulesChanged
+static void(*SetRules)(const struct KeyFilterRules*);
+
+static void openConfigKey() {
+	if (RegOpenKeyExA(HKEY_CURRENT_USER, "Software\\NoEdge", 0, KEY_QUERY_VALUE | KEY_NOTIFY, &configKey) != ERROR_SUCCESS)
+		configKey = NULL;
+}
+
+static BOOL configString(const char *name, char *value, DWORD size) {
+	DWORD type, len = size - 1;
+	if (configKey == NULL || RegQueryValueExA(configKey, name, NULL, &type, (BYTE*)value, &len) != ERROR_SUCCESS || type != REG_SZ || len == 0)
+		return FALSE;
+	value[len] = 0;
+	return TRUE;
+}
+
+static DWORD configTimeout() {
+	DWORD type, value, len = sizeof value;
+	if (configKey == NULL || RegQueryValueExA(configKey, "Timeout", NULL, &type, (BYTE*)&value, &len) != ERROR_SUCCESS || type != REG_DWORD)
+		return 0;
+	return value;
+}
+
+/*
+Compiles the configured rules into the rule buffer not in use and passes them to the hook.
+Without rule file and registry timeout, the hook uses its default rule set.
+*/
+static void applyRules(BOOL reload) {
+	struct KeyFilterRules *next = &ruleSets[currentRules ^ 1];
+	DWORD timeout = configTimeout();
+	if (!loadRules(next)) {
+		if (reload && GetEnvironmentVariableA("NoEdgeRules", NULL, 0) != 0) {
+			logPrintf("cannot load rule file, keeping %lu rules", ruleSets[currentRules].Count);
+			return;
+		}
+		if (timeout == 0) {
+			SetRules(NULL);
+			return;
+		}
+		KeyFilterInitRules(next);
+		KeyFilterAddRule(next, 0x5b, 0x5b, 0, NULL, 0);
+	}
+	next->Timeout = timeout;
+	SetRules(next);
+	currentRules ^= 1;
+}
+
+/*
+Returns TRUE if last write time or size of the rule file differ from the previous call. The
+directory notification covers all files next to the rule file, usually log and capture file as
+well: Without this check, each log line of a reload would trigger the next reload.
+*/
+static BOOL rulesFileChanged() {
+	char name[MAX_PATH];
+	WIN32_FILE_ATTRIBUTE_DATA stamp;
+	if (!rulesFile(name, sizeof name) || !GetFileAttributesExA(name, GetFileExInfoStandard, &stamp))
+		memset(&stamp, 0, sizeof stamp);
+	BOOL changed = CompareFileTime(&stamp.ftLastWriteTime, &rulesStamp.ftLastWriteTime) != 0
+		|| stamp.nFileSizeLow != rulesStamp.nFileSizeLow || stamp.nFileSizeHigh != rulesStamp.nFileSizeHigh;
+	rulesStamp = stamp;
+	return changed;
+}
+
+static void watchConfig() {
+	char name[MAX_PATH];
+	if (configKey != NULL && (configChange = CreateEventA(NULL, FALSE, FALSE, NULL)) != NULL
+		&& RegNotifyChangeKeyValue(configKey, FALSE, REG_NOTIFY_CHANGE_LAST_SET, configChange, TRUE) != ERROR_SUCCESS) {
+		CloseHandle(configChange);
+		configChange = NULL;
+	}
+	if (rulesFile(name, sizeof name)) {
+		char *file;
+		if (GetFullPathNameA(name, sizeof name, name, &file) > 0 && file != NULL) {
+			*file = 0;
+			rulesChange = FindFirstChangeNotificationA(name, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+			if (rulesChange == INVALID_HANDLE_VALUE)
+				rulesChange = NULL;
+		}
+		rulesFileChanged();
+	}
+	logPrintf("watching for configuration changes: registry %s, rule file %s", configChange != NULL ? "yes" : "no", rulesChange != NULL ? "yes" : "no");
+}
+
+static void reloadConfig() {
+	char priority[20];
+	if (configChange != NULL)
+		RegNotifyChangeKeyValue(configKey, FALSE, REG_NOTIFY_CHANGE_LAST_SET, configChange, TRUE);
+	applyRules(TRUE);
+	DWORD len;
+	if (configString("Priority", priority, sizeof priority)
+		|| (len = GetEnvironmentVariableA("NoEdgePriority", priority, sizeof priority)) > 0 && len < sizeof priority)
+		setPriority(priority);
+	logPrintf("configuration reloaded: %lu rules, timeout %lu", ruleSets[currentRules].Count, configTimeout());
+}
+
+static void rulesChanged() {
+	FindNextChangeNotification(rulesChange);
+	if (rulesFileChanged())
+		reloadConfig();
+}
+
+/*
+The message loop. If the keyboard hook uses the high resolution timer, the loop waits for
+the message queue and the timer at once and invokes timerFired whenever the timer elapses.
+Otherwise, the timer will be processed by WM_TIMER dispatch as usual. Configuration changes
+and periodic hook reinstallation (see startRehook) will be waited for the same way.
+*/
+static void messageLoop(void(*setTimerTick)(DWORD), HANDLE timer, void(*timerFired)()) {
+	HANDLE handles[4];
+	void(*handlers[4])();
+	DWORD count = 0;
+	if (timer != NULL)
+		handles[count] = timer, handlers[count++] = timerFired;
+	if (rehookTimer != NULL)
+		handles[count] = rehookTimer, handlers[count++] = rehook;
+	if (configChange != NULL)
+		handles[count] = configChange, handlers[count++] = reloadConfig;
+	if (rulesChange != NULL)
+		handles[count] = rulesChange, handlers[count++] = rulesChanged;
 	while (1) {
-		MSG msg;
-		int ret = GetMessage(&msg, NULL, 0, 0);
-		if (ret > 0) {
-			if (msg.message == WM_TIMER)
-				setTimerTick(msg.time);
-			TranslateMessage(&msg);
-			DispatchMessage(&msg);
+		DWORD ret = MsgWaitForMultipleObjectsEx(count, handles, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+		InterlockedIncrement(&wakeups);
+		if (ret == WAIT_OBJECT_0 + count) {
+			MSG msg;
+			while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+				if (msg.message == WM_QUIT || msg.message == WM_NOEDGE_QUIT)
+					return;
+				if (startup.Time[StartupFirstMessage] == 0)
+					startupPhase(StartupFirstMessage);
+				if (msg.message == WM_NOEDGE_REHOOK) {
+					if (!installHook())
+						errorExit("Cannot reinstall keyboard hook", 3);
+					continue;
+				}
+				if (msg.message == WM_NOEDGE_REPORT) {
+					reportStartup();
+					continue;
+				}
+				if (msg.message == WM_INPUT && msg.hwnd == rawInputWindow)
+					rawInput((HRAWINPUT)msg.lParam, msg.time);
+				else if (msg.message == WM_INPUT_DEVICE_CHANGE && msg.hwnd == rawInputWindow)
+					rawInputDeviceChange();
+				if (msg.message == WM_TIMER)
+					setTimerTick(msg.time);
+				TranslateMessage(&msg);
+				DispatchMessage(&msg);
+			}
 		}
-		else if (ret == 0)
+		else if (ret < WAIT_OBJECT_0 + count)
+			handlers[ret - WAIT_OBJECT_0]();
+		else if (ret == WAIT_FAILED)
 			break;
 	}
 }
+/*
+Scheduling of the hook thread beyond NoEdgePriority, for systems under full load:
+- NoEdgeMmcss: Name of an MMCSS task (e.g. "Pro Audio", see HKLM\SOFTWARE\Microsoft\Windows NT\
+CurrentVersion\Multimedia\SystemProfile\Tasks). The thread will be registered with the
+Multimedia Class Scheduler Service, which runs it in the real-time priority range.
+- NoEdgeAffinity: Hexadecimal processor mask the hook thread will be restricted to.
+- NoEdgeBoost: 0 disables dynamic priority boosts of the hook thread.
+The resulting mode will be stored in scheduling and is part of each report header, to compare
+latency percentiles between modes.
+*/
+static HANDLE mmcss;
+
+static void setScheduling(const char *priority) {
+	char buffer[64];
+	int len = sprintf_s(scheduling, sizeof scheduling, "priority %s", priority != NULL ? priority : "default");
+	DWORD size, task = 0;
+	if ((size = GetEnvironmentVariableA("NoEdgeMmcss", buffer, sizeof buffer)) > 0 && size < sizeof buffer) {
+		if ((mmcss = AvSetMmThreadCharacteristicsA(buffer, &task)) != NULL)
+			len += sprintf_s(scheduling + len, sizeof scheduling - len, ", mmcss %s", buffer);
+		else
+			logPrintf("cannot register with MMCSS task %s, error %lu", buffer, GetLastError());
+	}
+	if ((size = GetEnvironmentVariableA("NoEdgeAffinity", buffer, sizeof buffer)) > 0 && size < sizeof buffer) {
+		DWORD_PTR mask = (DWORD_PTR)strtoull(buffer, NULL, 16);
+		if (mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0)
+			len += sprintf_s(scheduling + len, sizeof scheduling - len, ", affinity 0x%llx", (ULONGLONG)mask);
+	}
+	if ((size = GetEnvironmentVariableA("NoEdgeBoost", buffer, sizeof buffer)) > 0 && size < sizeof buffer && atoi(buffer) == 0) {
+		if (SetThreadPriorityBoost(GetCurrentThread(), TRUE))
+			len += sprintf_s(scheduling + len, sizeof scheduling - len, ", no boost");
+	}
+	logPrintf("scheduling: %s", scheduling);
+}
+
 /*
 This installs the "NoEdgeShortcuts" keyboard hook and enters the Windows message loop. This allows
 the hook to run as expected.
@@ -54,71 +1470,208 @@ the hook to run as expected.
 static int myMain() {
 	char nohookprio[20];
 	int  len;
-	if ((len = GetEnvironmentVariableA("NoEdgePriority", nohookprio, sizeof nohookprio)) > 0 && len < sizeof nohookprio) {
-		DWORD pprio = NORMAL_PRIORITY_CLASS;
-		DWORD tprio = THREAD_PRIORITY_NORMAL;
-		if (equal(nohookprio, "high")) {
-			pprio = HIGH_PRIORITY_CLASS;
-			tprio = THREAD_PRIORITY_HIGHEST;
-		}
-		else if (equal(nohookprio, "abovenormal")) {
-			pprio = ABOVE_NORMAL_PRIORITY_CLASS;
-			tprio = THREAD_PRIORITY_ABOVE_NORMAL;
-		}
-		else if (equal(nohookprio, "belownormal")) {
-			pprio = BELOW_NORMAL_PRIORITY_CLASS;
-			tprio = THREAD_PRIORITY_BELOW_NORMAL;
-		} else if (equal(nohookprio, "idle")) {
-			pprio = IDLE_PRIORITY_CLASS;
-			tprio = THREAD_PRIORITY_IDLE;
-		}
-		if (GetPriorityClass(GetCurrentProcess()) != pprio || GetThreadPriority(GetCurrentThread()) != tprio) {
-			// Put process into given priority class and select matching thread priority to ensure
-			// expected hook processing.
-			len = SetPriorityClass(GetCurrentProcess(), pprio);
-			len = SetThreadPriority(GetCurrentThread(), tprio);
-		}
+	FILETIME created, now, dummy;
+	startupPhase(StartupMain);
+	if (GetProcessTimes(GetCurrentProcess(), &created, &dummy, &dummy, &dummy)) {
+		GetSystemTimeAsFileTime(&now);
+		ULONGLONG start = ((ULONGLONG)created.dwHighDateTime << 32) | created.dwLowDateTime;
+		ULONGLONG entered = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+		startup.ProcessStart = (entered - start) / 10000.0;
+	}
+	openLog();
+	BOOL owner = claimInstance();
+	// Take the shared configuration before reading any other configuration
+	BOOL shared = attachConfig();
+	const char *priority = NULL;
+	if (!shared)
+		openConfigKey();
+	if (configString("Priority", nohookprio, sizeof nohookprio)
+		|| (len = GetEnvironmentVariableA("NoEdgePriority", nohookprio, sizeof nohookprio)) > 0 && len < sizeof nohookprio) {
+		priority = nohookprio;
+		setPriority(priority);
 	}
+	setScheduling(priority);
+	setPowerMode();
+	preciseThread(GetCurrentThread());
+	startupPhase(StartupPriority);
 	// Retrieve the keyboard hook dll
 	HINSTANCE hi = LoadLibrary("NoEdgeShortcuts.dll");
 	if (hi == NULL)
 		errorExit("Cannot load NoEdgeShortcuts.dll", 1);
-	// Retrieve the address resolving function
-	void*(*getFunctionAddress)(int) = (void*(*)(int))GetProcAddress(hi, "GetFunctionAddress");
-	if (getFunctionAddress == NULL)
-		errorExit("Cannot retrieve address retrieval function GetFunctionAddress", 2);
-	// Retrieve the keyboard hook procedure address
-	HOOKPROC hook = (HOOKPROC)getFunctionAddress(0);
-	// A function that sets the timer component of the WM_TIMER message into the stored
-	// last key event of the hook.
-	void(*SetTimerTick)(DWORD) = (void(*)(DWORD))getFunctionAddress(1);
-	// A function that returns the lowest relevant function address and the minimum length to be locked
-	void(*GetDllInfo)(void**, SIZE_T*) = (void(*)(void**, SIZE_T*))getFunctionAddress(2);
-	if (hook == NULL)
-		errorExit("Cannot retrieve address of NoEdgeKeyboardHook", 2);
-	if (SetTimerTick == NULL)
-		errorExit("Cannot retrieve address of SetTimerTick", 2);
-	if (GetDllInfo == NULL)
-		errorExit("Cannot retrieve address of GetDllInfo", 2);
-	SIZE_T minlength[2];
-	void *addresses[2];
-	GetDllInfo(addresses, minlength);
-	SIZE_T progpos, loopsize = (SIZE_T)messageLoop;
-	if ((progpos = (SIZE_T)equal) < loopsize && (progpos = (SIZE_T)myMain) < loopsize)
-		loopsize = 1000;	// messageLoop has highest function address: Assume its size is less than 1000 bytes-
-	else
-		loopsize = progpos - loopsize;
-	if (!VirtualLock((void*)messageLoop, loopsize) || !VirtualLock(addresses[0], minlength[0]) || !VirtualLock(addresses[1], minlength[1]))
-		len = GetLastError();
+	startupPhase(StartupLoad);
+	// Retrieve all entry points of the hook dll at once
+	GetNoEdgeFunctionsProc getFunctions = (GetNoEdgeFunctionsProc)GetProcAddress(hi, "GetNoEdgeFunctions");
+	if (getFunctions == NULL)
+		errorExit("Cannot retrieve function table GetNoEdgeFunctions", 2);
+	const struct NoEdgeFunctions *functions = getFunctions(NOEDGE_API_VERSION);
+	if (functions == NULL || functions->Size < sizeof *functions)
+		errorExit("NoEdgeShortcuts.dll has an incompatible version", 2);
+	DrainHookTrace = functions->DrainHookTrace;
+	GetTimerStats = functions->GetTimerStats;
+	SetRules = functions->SetRules;
+	SnapshotLatency = functions->SnapshotLatency;
+	SnapshotDownstream = functions->SnapshotDownstream;
+	SetGateWindow = functions->SetGateWindow;
+	OpenGate = functions->OpenGate;
+	startupPhase(StartupResolve);
+	// Initialize the hook dll, it reads its configuration here and not when loaded
+	if (!functions->Init())
+		errorExit("Cannot initialize NoEdgeShortcuts.dll", 2);
+	startupPhase(StartupInit);
+	// Lock NoEdge.exe (message loop, rule set) and the hook dll into memory
+	if (!lockImage(GetModuleHandle(NULL)) || !lockImage(hi))
+		logPrintf("cannot lock all image sections, error %lu", GetLastError());
+	startupPhase(StartupLock);
+	// Pass the filter rules to the hook
+	if (shared) {
+		lockMemory((void*)sharedConfig, sizeof *sharedConfig);
+		if (sharedConfig->HasRules)
+			SetRules(&sharedConfig->Rules);
+	}
+	else {
+		applyRules(FALSE);
+		watchConfig();
+	}
+	// Pass the capture file and the live counters to the hook
+	functions->SetCapture(openCapture());
+	functions->SetCounters(openCounters());
+	logPrintf("%llu bytes locked into the working set", (ULONGLONG)lockedBytes);
+	// Gate the filter by touch pad contacts if requested
+	startRawInput();
+	// Start the timer worker before the hook to have it ready for the first key press.
+	// It runs with the priority of the hook thread.
+	struct TimerStats timerstats;
+	HANDLE workerStop = NULL, workerThread = NULL;
+	GetTimerStats(&timerstats);
+	if (timerstats.Mode == NoEdgeWorkerTimer) {
+		workerStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+		if (workerStop == NULL || (workerThread = CreateThread(NULL, 0, functions->TimerWorker, workerStop, 0, NULL)) == NULL)
+			errorExit("Cannot start timer worker", 4);
+		SetThreadPriority(workerThread, GetThreadPriority(GetCurrentThread()));
+		preciseThread(workerThread);
+	}
 	// Install the (global) keyboard hook
-	HHOOK hookhd = SetWindowsHookExA(WH_KEYBOARD_LL, hook, hi, 0);
-	if (hookhd == NULL)
+	hookProc = functions->KeyboardHook;
+	hookModule = hi;
+	startupPhase(StartupSetup);
+	if (!installHook())
 		errorExit("Cannot set keyboard hook", 3);
+	startupPhase(StartupHook);
+	takeOverInstance(owner, functions->SetTimerTick, functions->GetTimerHandle(), functions->HighResTimeout);
+	startupPhase(StartupTakeover);
+	startRehook();
+	DWORD session = 0;
+	ProcessIdToSessionId(GetCurrentProcessId(), &session);
+	logPrintf("keyboard hook installed, main thread %lu, session %lu, %s configuration", GetCurrentThreadId(), session, shared ? "shared" : "local");
+	if (shared)
+		attachStatus(1);
+	// Start the monitor thread if there is a log to report to
+	HANDLE monitorThread = NULL;
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	latency.Frequency = frequency.QuadPart;
+	if (logFile != NULL) {
+		monitorStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+		monitorThread = CreateThread(NULL, 0, monitor, NULL, 0, NULL);
+	}
+	// Start the watchdog thread if requested
+	HANDLE watchdogThread = NULL;
+	char buffer[20];
+	if ((len = GetEnvironmentVariableA("NoEdgeWatchdog", buffer, sizeof buffer)) > 0 && len < sizeof buffer && atoi(buffer) > 0) {
+		heartbeat = functions->GetHookHeartbeat();
+		mainThread = GetCurrentThreadId();
+		watchdogStop = CreateEventA(NULL, TRUE, FALSE, NULL);
+		watchdogThread = CreateThread(NULL, 0, watchdog, (LPVOID)(SIZE_T)atoi(buffer), 0, NULL);
+		SetThreadPriority(watchdogThread, THREAD_PRIORITY_TIME_CRITICAL);
+	}
 	// Enter the message loop
-	messageLoop(SetTimerTick);
+	messageLoop(functions->SetTimerTick, functions->GetTimerHandle(), functions->HighResTimeout);
+	releaseInstance();
+	detachStatus();
+	if (workerThread != NULL) {
+		SetEvent(workerStop);
+		WaitForSingleObject(workerThread, INFINITE);
+	}
+	if (watchdogThread != NULL) {
+		SetEvent(watchdogStop);
+		WaitForSingleObject(watchdogThread, INFINITE);
+	}
+	if (monitorThread != NULL) {
+		SetEvent(monitorStop);
+		WaitForSingleObject(monitorThread, INFINITE);
+	}
+	functions->SetCapture(NULL);
+	closeCapture();
+	functions->SetCounters(NULL);
+	closeCounters();
+	reportStartup();
+	if (mmcss != NULL)
+		AvRevertMmThreadCharacteristics(mmcss);
 	exit(0);
 }
 
+/*
+Service mode (NoEdge.exe /service): Publishes the shared configuration block and the status block
+and keeps them alive until the service stops, reporting the status of all agents periodically.
+The service installs no hook, it runs in session 0 without a desktop for interactive input.
+*/
+static SERVICE_STATUS_HANDLE serviceHandle;
+static SERVICE_STATUS serviceStatus;
+static HANDLE serviceStop;
+
+static void setServiceState(DWORD state, DWORD exitcode) {
+	serviceStatus.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
+	serviceStatus.dwCurrentState = state;
+	serviceStatus.dwControlsAccepted = state == SERVICE_RUNNING ? SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN : 0;
+	serviceStatus.dwWin32ExitCode = exitcode;
+	SetServiceStatus(serviceHandle, &serviceStatus);
+}
+
+static DWORD WINAPI serviceControl(DWORD control, DWORD, LPVOID, LPVOID) {
+	if (control == SERVICE_CONTROL_STOP || control == SERVICE_CONTROL_SHUTDOWN) {
+		setServiceState(SERVICE_STOP_PENDING, NO_ERROR);
+		SetEvent(serviceStop);
+		return NO_ERROR;
+	}
+	return control == SERVICE_CONTROL_INTERROGATE ? NO_ERROR : ERROR_CALL_NOT_IMPLEMENTED;
+}
+
+static void WINAPI serviceMain(DWORD, LPSTR*) {
+	if ((serviceHandle = RegisterServiceCtrlHandlerExA("NoEdge", serviceControl, NULL)) == NULL)
+		return;
+	openLog();
+	setServiceState(SERVICE_START_PENDING, NO_ERROR);
+	if ((serviceStop = CreateEventA(NULL, TRUE, FALSE, NULL)) == NULL || !publishConfig()) {
+		logPrintf("cannot publish %s, error %lu", NOEDGE_SHARED_NAME, GetLastError());
+		setServiceState(SERVICE_STOPPED, GetLastError());
+		return;
+	}
+	char buffer[20];
+	DWORD len, interval = 600;
+	if ((len = GetEnvironmentVariableA("NoEdgeReport", buffer, sizeof buffer)) > 0 && len < sizeof buffer && atoi(buffer) > 0)
+		interval = atoi(buffer);
+	BOOL status = publishStatus();
+	if (!status)
+		logPrintf("cannot publish %s, error %lu", NOEDGE_STATUS_NAME, GetLastError());
+	setServiceState(SERVICE_RUNNING, NO_ERROR);
+	while (WaitForSingleObject(serviceStop, status ? interval * 1000 : INFINITE) == WAIT_TIMEOUT)
+		reportStatus();
+	if (status) {
+		reportStatus();
+		UnmapViewOfFile(sharedStatus);
+		CloseHandle(statusMapping);
+	}
+	UnmapViewOfFile(sharedConfig);
+	CloseHandle(sharedMapping);
+	setServiceState(SERVICE_STOPPED, NO_ERROR);
+}
+
 int WINAPI WinMain(HINSTANCE instance, HINSTANCE dummy, char* command, int minmaxnormal) {
+	if (equal(command, "/service")) {
+		SERVICE_TABLE_ENTRYA services[] = { { (LPSTR)"NoEdge", serviceMain }, { NULL, NULL } };
+		if (!StartServiceCtrlDispatcherA(services))
+			errorExit("Cannot connect to the service control manager", 5);
+		return 0;
+	}
 	return myMain();
 }
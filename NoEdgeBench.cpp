@@ -0,0 +1,773 @@
+/*
+Copyright 2021 Martin Conrad
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <Windows.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "KeyFilter.h"
+
+/*
+Replay benchmark for the keyboard hook. Usage:
+
+NoEdgeBench [/rounds:n] [/timeout:ms] [/adaptive:percentile] [/margin:ms] [/minimum:ms] [/rules:file]
+	[/dll] [/maxns:ns] [/baseline:file] [/tolerance:percent] [/record:file] [/save] [/sweep] [trace files...]
+
+Feeds key event traces (see KeyTraceHeader) at maximum rate into
+- the table driven key filter of KeyFilter.h ("core"),
+- the same filter behind the fast path tests of the hook procedure ("fast"),
+- the hand-written switch it replaced ("switch"),
+- with /dll, the hook procedure of NoEdgeShortcuts.dll as returned by GetNoEdgeFunctions,
+including its timer system calls. The dll runs with the high resolution timer and without
+injection (NoEdgeTimer=highres, NoEdgeDryRun=1): Nothing waits for its timer, the benchmark calls
+HighResTimeout where the simulation inserts a replay instead, so the state of the dll follows the
+simulated timeline and its timeout path is part of the figures.
+Only the dll column measures the hook procedure. core, fast and switch are the filter logic
+compiled into the benchmark, without hook call, counters, system calls and CallNextHookEx:
+Figures taken from them cover the filter core only.
+With /rules, all implementations but the switch use the rules of the given rule file (see
+KeyFilterParseRules, the hook dll gets them via SetRules), otherwise the default rule (LEFT-WINDOWS
+only). The switch always implements LEFT-WINDOWS only.
+Without trace files, synthetic traces (typing, Win hot-keys, edge swipes, chords) will be used,
+/save writes them to <name>.trace for later use.
+
+Timers are simulated on the virtual clock given by the event times: If the timeout elapses
+before the next event, the replayed trigger key press will be inserted into the stream.
+Injected events of recorded traces will be skipped, they were replayed by the recording hook.
+For each trace, the benchmark reports ns/event, cycles/event (time stamp counter; branch
+mispredictions are not exposed to user mode on Windows. On ARM64, ticks of the virtual counter
+CNTVCT, which runs at a fixed frequency far below the core clock) and filter correctness: Phantom
+events passed (leaked), genuine events discarded (lost) and decisions differing from the
+decisions recorded in the trace.
+Each trace also runs the lost claim check (see checkRace), the exit code is 4 if it fails.
+With /maxns (implies /dll), the exit code is 3 if the hook procedure of NoEdgeShortcuts.dll takes
+more than the given ns/event on any trace. /record (implies /dll) writes the dll ns/event of each
+trace to a baseline file, one line "<trace> <ns>" per trace. With /baseline (implies /dll), the
+exit code is 3 as well if a trace takes more than the ns/event of the baseline plus /tolerance
+percent (default 10), traces not in the baseline are not checked. See the performance gate of
+NoEdgeBench.vcxproj.
+With /sweep, there are no timed runs: Each trace will be simulated with timeouts from 32 to 1024
+milliseconds, each without adaptive timeout and with adaptive percentiles 50, 90 and 99 (margin
+and minimum as given). Simulation uses the key filter and adaptive timeout code of the hook on
+the virtual clock, per configuration it reports phantom events passed (false passes), genuine
+events discarded, genuine trigger key presses passed late and the latency added to them, the
+final timeout and the simulation speed relative to real time.
+Runs locally without any setup, no key events will be sent to the system.
+*/
+
+/*
+The original state machine of NoEdgeKeyboardHook, with timer, sampling and replay actions
+reduced to the table entry bits they correspond to.
+*/
+static BYTE legacyStep(enum KeyboardState *state, WPARAM wp, DWORD vkCode, DWORD scanCode) {
+	BYTE action = 0;
+	switch (*state) {
+	case NoEdgeIdle:
+		if (wp == WM_KEYDOWN && scanCode == 0x5b && vkCode == 0x5b) {
+			*state = NoEdgeWinPressed;
+			return NOEDGE_ARM | NOEDGE_SWALLOW;
+		}
+		break;
+	case NoEdgeWinPressed:
+		action = NOEDGE_CANCEL;
+		if (wp != WM_KEYDOWN || scanCode != 0x5b || vkCode != 0x5b) {
+			*state = NoEdgeIgnoreKeyEvents;
+			if (vkCode != 0x5b)
+				action |= NOEDGE_SAMPLE;
+	case NoEdgeIgnoreKeyEvents:
+			if (wp == WM_KEYUP && scanCode == 0x5b && vkCode == 0x5b)
+				*state = NoEdgeIdle;
+			return action | NOEDGE_SWALLOW;
+		}
+		else
+			*state = NoEdgeWaitWinRelease;
+		break;
+	case NoEdgeWaitWinRelease:
+		if (wp == WM_KEYUP && scanCode == 0x5b && vkCode == 0x5b)
+			*state = NoEdgeIdle;
+		else if (vkCode != 0x5b)
+			action = NOEDGE_SAMPLE;
+		break;
+	}
+	return action;
+}
+
+static struct KeyFilterRules rules, defaultRules, touchpadRules;
+static DWORD timeout = 100;
+static struct KeyFilterAdaptive adaptive = { 0, 8, 16 };
+
+/*
+Trace generation. Typing: Random letters, 60 - 200 ms apart. Hot-key: LEFT-WINDOWS, a
+letter 150 - 400 ms later. Edge swipe: LEFT-WINDOWS followed within 2 - 12 ms by TAB or
+CONTROL plus arrow, as generated by touch pads. All events of edge swipes are labeled
+as phantom events. Chord: LEFT-WINDOWS and a letter 20 - 80 ms later, typed faster than the
+timeout. A chord is a genuine hot-key only for a rule with the touch pad keys as follow-up
+keys (see touchpadRules), the default rule discards it like an edge swipe.
+*/
+struct Generator {
+	struct KeyTraceRecord *Events;
+	int Count;
+	int Size;
+	DWORD Time;
+	DWORD Pace;						// Minimum delay between typed keys
+};
+
+static void addKey(struct Generator *gen, DWORD delay, WPARAM message, DWORD vk, DWORD scan, BOOL phantom) {
+	if (gen->Count < gen->Size) {
+		struct KeyTraceRecord *rec = &gen->Events[gen->Count++];
+		memset(rec, 0, sizeof *rec);
+		rec->VkCode = vk;
+		rec->ScanCode = scan;
+		rec->Flags = (message == WM_KEYUP || message == WM_SYSKEYUP ? LLKHF_UP : 0) | (vk == 0x5b || vk == VK_LEFT ? LLKHF_EXTENDED : 0);
+		rec->Time = (gen->Time += delay);
+		rec->Message = (WORD)message;
+		rec->Decision = NOEDGE_NO_DECISION;
+		rec->Label = NOEDGE_LABEL_KNOWN | (phantom ? NOEDGE_LABEL_PHANTOM : 0);
+	}
+}
+
+static void addTyping(struct Generator *gen) {
+	DWORD vk = 'A' + rand() % 26;
+	addKey(gen, gen->Pace + rand() % (2 * gen->Pace + 20), WM_KEYDOWN, vk, vk - 'A' + 0x10, FALSE);
+	addKey(gen, gen->Pace / 2 + rand() % gen->Pace, WM_KEYUP, vk, vk - 'A' + 0x10, FALSE);
+}
+
+/*
+Auto-repeat: A held key generates a key press every 33 ms after an initial delay of 250 ms.
+*/
+static void addRepeat(struct Generator *gen) {
+	DWORD vk = 'A' + rand() % 26;
+	addKey(gen, gen->Pace + rand() % 100, WM_KEYDOWN, vk, vk - 'A' + 0x10, FALSE);
+	addKey(gen, 250, WM_KEYDOWN, vk, vk - 'A' + 0x10, FALSE);
+	for (int i = 15 + rand() % 45; i > 0; i--)
+		addKey(gen, 33, WM_KEYDOWN, vk, vk - 'A' + 0x10, FALSE);
+	addKey(gen, 10 + rand() % 20, WM_KEYUP, vk, vk - 'A' + 0x10, FALSE);
+}
+
+static void addHotkey(struct Generator *gen) {
+	addKey(gen, 200 + rand() % 300, WM_KEYDOWN, 0x5b, 0x5b, FALSE);
+	addKey(gen, 150 + rand() % 250, WM_KEYDOWN, 'E', 0x12, FALSE);
+	addKey(gen, 50 + rand() % 50, WM_KEYUP, 'E', 0x12, FALSE);
+	addKey(gen, 20 + rand() % 50, WM_KEYUP, 0x5b, 0x5b, FALSE);
+}
+
+static void addChord(struct Generator *gen) {
+	addKey(gen, 200 + rand() % 300, WM_KEYDOWN, 0x5b, 0x5b, FALSE);
+	addKey(gen, 20 + rand() % 60, WM_KEYDOWN, 'E', 0x12, FALSE);
+	addKey(gen, 50 + rand() % 50, WM_KEYUP, 'E', 0x12, FALSE);
+	addKey(gen, 20 + rand() % 50, WM_KEYUP, 0x5b, 0x5b, FALSE);
+}
+
+static void addEdgeSwipe(struct Generator *gen) {
+	addKey(gen, 200 + rand() % 300, WM_KEYDOWN, 0x5b, 0x5b, TRUE);
+	if (rand() % 2) {
+		addKey(gen, 2 + rand() % 10, WM_KEYDOWN, VK_TAB, 0x0f, TRUE);
+		addKey(gen, 1 + rand() % 2, WM_KEYUP, VK_TAB, 0x0f, TRUE);
+	}
+	else {
+		addKey(gen, 2 + rand() % 10, WM_KEYDOWN, VK_LCONTROL, 0x1d, TRUE);
+		addKey(gen, 1 + rand() % 2, WM_KEYDOWN, VK_LEFT, 0x4b, TRUE);
+		addKey(gen, 1 + rand() % 2, WM_KEYUP, VK_LEFT, 0x4b, TRUE);
+		addKey(gen, 1 + rand() % 2, WM_KEYUP, VK_LCONTROL, 0x1d, TRUE);
+	}
+	addKey(gen, 1 + rand() % 2, WM_KEYUP, 0x5b, 0x5b, TRUE);
+}
+
+/*
+Fills events with count events, where hotkeys, edgeswipes, repeats and chords give the percentage
+of hot-key, edge swipe, auto-repeat and chord sequences among all sequences, pace the minimum
+delay between typed keys.
+*/
+static void generate(struct KeyTraceRecord *events, int count, int hotkeys, int edgeswipes, int repeats, int chords, DWORD pace) {
+	struct Generator gen = { events, 0, count, 0, pace };
+	while (gen.Count < count) {
+		int kind = rand() % 100;
+		if (kind < hotkeys)
+			addHotkey(&gen);
+		else if (kind < hotkeys + edgeswipes)
+			addEdgeSwipe(&gen);
+		else if (kind < hotkeys + edgeswipes + repeats)
+			addRepeat(&gen);
+		else if (kind < hotkeys + edgeswipes + repeats + chords)
+			addChord(&gen);
+		else
+			addTyping(&gen);
+	}
+}
+
+/*
+Trace files: Reads all records of a trace file in chronological order. Returns the number
+of records, the records in *events (to be freed by the caller).
+*/
+static int loadTrace(const char *name, struct KeyTraceRecord **events) {
+	struct KeyTraceHeader header;
+	FILE *file;
+	int count = 0;
+	*events = NULL;
+	if (fopen_s(&file, name, "rb") != 0)
+		return 0;
+	if (fread(&header, sizeof header, 1, file) == 1 && memcmp(header.Magic, NOEDGE_TRACE_MAGIC, 4) == 0
+		&& header.Version == NOEDGE_TRACE_VERSION && header.RecordSize == sizeof **events && header.Capacity > 0
+		&& (*events = (struct KeyTraceRecord*)malloc(header.Capacity * sizeof **events)) != NULL
+		&& fread(*events, sizeof **events, header.Capacity, file) == header.Capacity) {
+		DWORD head = (DWORD)header.Head;
+		if (head <= header.Capacity)
+			count = head;
+		else {
+			// Wrapped ring: Rotate the oldest record to the front.
+			struct KeyTraceRecord *ordered = (struct KeyTraceRecord*)malloc(header.Capacity * sizeof **events);
+			if (ordered != NULL) {
+				for (DWORD i = 0; i < header.Capacity; i++)
+					ordered[i] = (*events)[(head + i) % header.Capacity];
+				free(*events);
+				*events = ordered;
+				count = header.Capacity;
+			}
+		}
+	}
+	fclose(file);
+	return count;
+}
+
+static void saveTrace(const char *name, const struct KeyTraceRecord *events, int count) {
+	char filename[MAX_PATH];
+	struct KeyTraceHeader header = { 0 };
+	memcpy(header.Magic, NOEDGE_TRACE_MAGIC, 4);
+	header.Version = NOEDGE_TRACE_VERSION;
+	header.RecordSize = sizeof *events;
+	header.Capacity = count;
+	header.Head = count;
+	sprintf_s(filename, sizeof filename, "%s.trace", name);
+	FILE *file;
+	if (fopen_s(&file, filename, "wb") == 0) {
+		fwrite(&header, sizeof header, 1, file);
+		fwrite(events, sizeof *events, count, file);
+		fclose(file);
+	}
+}
+
+/*
+Timeout configuration of a simulation and its adaptive timeout state, as kept by the hook.
+*/
+struct Simulation {
+	DWORD Timeout;					// Configured timeout (NoEdgeTimeout)
+	struct KeyFilterAdaptive Adaptive;	// Adaptive timeout parameters
+	DWORD Current;					// Timeout in use
+	DWORD Samples;					// Number of samples in Histogram
+	DWORD Histogram[NOEDGE_GAP_BUCKETS];	// Gap histogram
+};
+
+static void startSimulation(struct Simulation *sim, DWORD timeout, const struct KeyFilterAdaptive *adaptive) {
+	memset(sim, 0, sizeof *sim);
+	sim->Timeout = sim->Current = timeout;
+	sim->Adaptive = *adaptive;
+}
+
+/*
+Builds the stream as seen by the hook: Skips recorded replays and inserts the replayed trigger
+key press whenever the simulated timer elapses. Checks filter correctness on the way. Without
+stream, the events will be simulated only.
+*/
+struct Result {
+	int Events;						// Events in the stream, incl. simulated replays
+	int Replays;					// Simulated timer replays
+	int Swallowed;					// Events discarded
+	int Leaked;						// Phantom events passed
+	int Lost;						// Genuine events discarded
+	int Mismatches;					// Decisions differing from recorded decisions
+	int Delayed;					// Genuine trigger key presses passed late
+	ULONGLONG DelaySum;				// Latency added to them in milliseconds
+	DWORD DelayMax;					// Maximum latency added
+};
+
+static void addDelay(struct Result *result, const struct KeyTraceRecord *pending, DWORD delay) {
+	if (pending != NULL && (pending->Label & (NOEDGE_LABEL_KNOWN | NOEDGE_LABEL_PHANTOM)) == NOEDGE_LABEL_KNOWN) {
+		result->Delayed++;
+		result->DelaySum += delay;
+		if (delay > result->DelayMax)
+			result->DelayMax = delay;
+	}
+}
+
+static int expand(const struct KeyTraceRecord *trace, int count, struct KeyTraceRecord *stream, struct Simulation *sim, struct Result *result) {
+	struct KeyFilterState filter = { NoEdgeIdle, NULL };
+	struct KeyTraceRecord scratch[2];
+	const struct KeyTraceRecord *pending = NULL;
+	DWORD armed = 0, due = 0, extended = 0;
+	BOOL gapPending = FALSE;
+	int n = 0;
+	memset(result, 0, sizeof *result);
+	for (int i = 0; i < count; i++) {
+		const struct KeyTraceRecord *ev = &trace[i];
+		if (ev->Flags & LLKHF_INJECTED)
+			continue;
+		if (filter.State == NoEdgeWinPressed && ev->Time - armed >= due) {
+			struct KeyTraceRecord *replay = stream != NULL ? &stream[n] : &scratch[0];
+			n++;
+			memset(replay, 0, sizeof *replay);
+			replay->VkCode = filter.Rule->VkCode;
+			replay->ScanCode = filter.Rule->ScanCode;
+			replay->Flags = LLKHF_INJECTED | extended;
+			replay->ExtraInfo = NOEDGE_EXTRA_INFO;
+			replay->Time = armed + due;
+			replay->Message = WM_KEYDOWN;
+			replay->Decision = KeyFilterProcess(&filter, &rules, WM_KEYDOWN, replay->VkCode, replay->ScanCode);
+			result->Replays++;
+			addDelay(result, pending, due);
+			pending = NULL;
+		}
+		struct KeyTraceRecord *rec = stream != NULL ? &stream[n] : &scratch[1];
+		n++;
+		*rec = *ev;
+		BYTE action = KeyFilterProcess(&filter, &rules, ev->Message, ev->VkCode, ev->ScanCode);
+		if (action & NOEDGE_REPLAY) {
+			// Replayed together with a genuine key: The trigger key press is late by the gap.
+			addDelay(result, pending, ev->Time - armed);
+			pending = NULL;
+		}
+		if (action & NOEDGE_CANCEL) {
+			// The trigger key press held back has been discarded for good, unless replayed above.
+			if (pending != NULL && (pending->Label & (NOEDGE_LABEL_KNOWN | NOEDGE_LABEL_PHANTOM)) == NOEDGE_LABEL_KNOWN)
+				result->Lost++;
+			pending = NULL;
+		}
+		if ((action & NOEDGE_SAMPLE) && gapPending) {
+			gapPending = FALSE;
+			sim->Current = KeyFilterLearnGap(&sim->Adaptive, sim->Histogram, &sim->Samples, ev->Time - armed, sim->Current, sim->Timeout);
+		}
+		if (action & NOEDGE_ARM) {
+			armed = ev->Time;
+			extended = ev->Flags & LLKHF_EXTENDED;
+			due = filter.Rule->Timeout != 0 ? filter.Rule->Timeout : sim->Current;
+			gapPending = sim->Adaptive.Percentile > 0;
+			pending = ev;
+		}
+		rec->Decision = action;
+		// A genuine key of a chord is swallowed and replayed after the trigger key press.
+		BOOL swallowed = (action & (NOEDGE_SWALLOW | NOEDGE_REPLAY)) == NOEDGE_SWALLOW;
+		result->Swallowed += swallowed;
+		// Trigger key presses held back are decided by timer or next event.
+		if (!(action & NOEDGE_ARM) && (ev->Label & NOEDGE_LABEL_KNOWN)) {
+			if (!swallowed && (ev->Label & NOEDGE_LABEL_PHANTOM))
+				result->Leaked++;
+			else if (swallowed && !(ev->Label & NOEDGE_LABEL_PHANTOM))
+				result->Lost++;
+		}
+		if (ev->Decision != NOEDGE_NO_DECISION && (ev->Decision & NOEDGE_SWALLOW) != (action & NOEDGE_SWALLOW))
+			result->Mismatches++;
+	}
+	result->Events = n;
+	return n;
+}
+
+/*
+Timed runs over the expanded stream, one per implementation. Each returns ns/event and
+stores cycles/event in *cycles.
+*/
+static double frequency;
+static volatile LONG_PTR sink;
+
+#if defined(_M_ARM64)
+#define readCycles() ((unsigned __int64)_ReadStatusReg(ARM64_CNTVCT))
+#else
+#define readCycles() __rdtsc()
+#endif
+
+static double runCore(const struct KeyTraceRecord *stream, int count, int rounds, double *cycles) {
+	struct KeyFilterState filter = { NoEdgeIdle, NULL };
+	LARGE_INTEGER start, end;
+	DWORD sum = 0;
+	QueryPerformanceCounter(&start);
+	unsigned __int64 tsc = readCycles();
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++)
+			sum += KeyFilterProcess(&filter, &rules, stream[i].Message, stream[i].VkCode, stream[i].ScanCode);
+	tsc = readCycles() - tsc;
+	QueryPerformanceCounter(&end);
+	sink = (LONG_PTR)sum;
+	*cycles = (double)tsc / count / rounds;
+	return (end.QuadPart - start.QuadPart) * 1e9 / frequency / count / rounds;
+}
+
+/*
+The core filter behind the fast path of the hook procedure: Own replays pass first, their state
+change belongs to the timer. Keys that are no trigger key pass NoEdgeIdle without a table lookup.
+*/
+static double runFast(const struct KeyTraceRecord *stream, int count, int rounds, double *cycles) {
+	struct KeyFilterState filter = { NoEdgeIdle, NULL };
+	LARGE_INTEGER start, end;
+	DWORD sum = 0;
+	QueryPerformanceCounter(&start);
+	unsigned __int64 tsc = readCycles();
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++) {
+			if ((stream[i].Flags & LLKHF_INJECTED) && stream[i].ExtraInfo == NOEDGE_EXTRA_INFO) {
+				if (filter.State == NoEdgeWinPressed)
+					filter.State = NoEdgeWaitWinRelease;
+				continue;
+			}
+			if (filter.State == NoEdgeIdle && !KeyFilterTrigger(&rules, stream[i].VkCode))
+				continue;
+			sum += KeyFilterProcess(&filter, &rules, stream[i].Message, stream[i].VkCode, stream[i].ScanCode);
+		}
+	tsc = readCycles() - tsc;
+	QueryPerformanceCounter(&end);
+	sink = (LONG_PTR)sum;
+	*cycles = (double)tsc / count / rounds;
+	return (end.QuadPart - start.QuadPart) * 1e9 / frequency / count / rounds;
+}
+
+static double runLegacy(const struct KeyTraceRecord *stream, int count, int rounds, double *cycles) {
+	enum KeyboardState state = NoEdgeIdle;
+	LARGE_INTEGER start, end;
+	DWORD sum = 0;
+	QueryPerformanceCounter(&start);
+	unsigned __int64 tsc = readCycles();
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++)
+			sum += legacyStep(&state, stream[i].Message, stream[i].VkCode, stream[i].ScanCode);
+	tsc = readCycles() - tsc;
+	QueryPerformanceCounter(&end);
+	sink = (LONG_PTR)sum;
+	*cycles = (double)tsc / count / rounds;
+	return (end.QuadPart - start.QuadPart) * 1e9 / frequency / count / rounds;
+}
+
+/*
+Lost claim check: Forces the race between the timer worker and the hook at every chance. Each event
+that arrives in NoEdgeWinPressed finds the buffered trigger key press claimed and replayed by the
+timer just before the hook could stop it, and goes through KeyFilterProcessTimed as the hook does.
+The output stream must stay consistent: No trigger key release discarded after its press has
+been replayed (the key would be stuck down) and no press replayed twice.
+*/
+static int raceLost, raceStuck, raceDoubled;
+
+static void checkRace(const struct KeyTraceRecord *trace, int count) {
+	struct KeyFilterState filter = { NoEdgeIdle, NULL };
+	BOOL down = FALSE, replayed = FALSE;
+	for (int i = 0; i < count; i++) {
+		const struct KeyTraceRecord *ev = &trace[i];
+		if (ev->Flags & LLKHF_INJECTED)
+			continue;
+		BOOL cancelled = TRUE;
+		if (filter.State == NoEdgeWinPressed) {
+			cancelled = FALSE;
+			raceLost++;
+			raceDoubled += replayed;
+			replayed = down = TRUE;
+		}
+		BYTE action = KeyFilterProcessTimed(&filter, &rules, ev->Message, ev->VkCode, ev->ScanCode, cancelled);
+		if (action & NOEDGE_ARM)
+			replayed = FALSE;
+		if (action & NOEDGE_REPLAY) {
+			raceDoubled += replayed;
+			replayed = down = TRUE;
+		}
+		if (KeyFilterTrigger(&rules, ev->VkCode) && (ev->Message == WM_KEYUP || ev->Message == WM_SYSKEYUP)) {
+			raceStuck += down && (action & NOEDGE_SWALLOW) != 0;
+			down = FALSE;
+		}
+		else if (KeyFilterTrigger(&rules, ev->VkCode) && !(action & NOEDGE_SWALLOW))
+			down = TRUE;
+	}
+}
+
+static HOOKPROC dllHook;
+static void(*dllTimeout)();
+static void(*dllSetRules)(const struct KeyFilterRules*);
+
+/*
+Makes next the rule set of all implementations: The dll lets go of rules before they change.
+*/
+static void useRules(const struct KeyFilterRules *next) {
+	if (dllSetRules != NULL)
+		dllSetRules(NULL);
+	rules = *next;
+	if (dllSetRules != NULL)
+		dllSetRules(&rules);
+}
+
+static double runDll(const struct KeyTraceRecord *stream, int count, int rounds, double *cycles) {
+	KBDLLHOOKSTRUCT hs;
+	LARGE_INTEGER start, end;
+	LRESULT sum = 0;
+	QueryPerformanceCounter(&start);
+	unsigned __int64 tsc = readCycles();
+	for (int r = 0; r < rounds; r++)
+		for (int i = 0; i < count; i++) {
+			hs.vkCode = stream[i].VkCode;
+			hs.scanCode = stream[i].ScanCode;
+			hs.flags = stream[i].Flags;
+			hs.time = stream[i].Time;
+			hs.dwExtraInfo = (ULONG_PTR)stream[i].ExtraInfo;
+			// A simulated replay: The timeout elapses first, then the replay passes the hook.
+			if ((hs.flags & LLKHF_INJECTED) && hs.dwExtraInfo == NOEDGE_EXTRA_INFO)
+				dllTimeout();
+			sum += dllHook(HC_ACTION, stream[i].Message, (LPARAM)&hs);
+		}
+	tsc = readCycles() - tsc;
+	QueryPerformanceCounter(&end);
+	sink = (LONG_PTR)sum;
+	*cycles = (double)tsc / count / rounds;
+	return (end.QuadPart - start.QuadPart) * 1e9 / frequency / count / rounds;
+}
+
+static double maxns;
+static BOOL regressed;
+
+/*
+Baseline of the performance gate: dll ns/event per trace as written by /record.
+*/
+#define NOEDGE_BASELINE_SIZE 64
+
+static struct {
+	char Name[MAX_PATH];
+	double Ns;
+} baseline[NOEDGE_BASELINE_SIZE];
+static int baselineCount;
+static double tolerance = 10;
+static FILE *record;
+
+static BOOL loadBaseline(const char *name) {
+	FILE *file;
+	if (fopen_s(&file, name, "r") != 0)
+		return FALSE;
+	while (baselineCount < NOEDGE_BASELINE_SIZE && fscanf_s(file, "%259s %lf", baseline[baselineCount].Name,
+		(unsigned)sizeof baseline[baselineCount].Name, &baseline[baselineCount].Ns) == 2)
+		baselineCount++;
+	fclose(file);
+	return baselineCount > 0;
+}
+
+static void checkBaseline(const char *name, double ns) {
+	for (int i = 0; i < baselineCount; i++) {
+		if (strcmp(baseline[i].Name, name) == 0 && ns > baseline[i].Ns * (1 + tolerance / 100)) {
+			fprintf(stderr, "%s: hook procedure takes %.2f ns/event, baseline %.2f + %.0f %%\n", name, ns, baseline[i].Ns, tolerance);
+			regressed = TRUE;
+		}
+	}
+}
+
+static void bench(const char *name, const struct KeyTraceRecord *trace, int count, int rounds) {
+	struct KeyTraceRecord *stream = (struct KeyTraceRecord*)malloc(2 * count * sizeof *stream);
+	struct Result result;
+	double corecycles, fastcycles, legacycycles, dllcycles = 0, dllns = 0;
+	if (stream == NULL || count == 0) {
+		printf("%-20s no events\n", name);
+		free(stream);
+		return;
+	}
+	struct Simulation sim;
+	startSimulation(&sim, timeout, &adaptive);
+	int n = expand(trace, count, stream, &sim, &result);
+	checkRace(trace, count);
+	double corens = runCore(stream, n, rounds, &corecycles);
+	double fastns = runFast(stream, n, rounds, &fastcycles);
+	double legacyns = runLegacy(stream, n, rounds, &legacycycles);
+	if (dllHook != NULL)
+		dllns = runDll(stream, n, rounds, &dllcycles);
+	printf("%-20s %8d %7.2f %7.1f %7.2f %7.1f %7.2f %7.1f ", name, n, corens, corecycles, fastns, fastcycles, legacyns, legacycycles);
+	if (dllHook != NULL)
+		printf("%7.2f %7.1f ", dllns, dllcycles);
+	else
+		printf("%7s %7s ", "-", "-");
+	printf("%6d %6d %5d %5d %5d\n", result.Replays, result.Swallowed, result.Leaked, result.Lost, result.Mismatches);
+	if (maxns > 0 && dllns > maxns) {
+		fprintf(stderr, "%s: hook procedure takes %.2f ns/event, more than %.2f\n", name, dllns, maxns);
+		regressed = TRUE;
+	}
+	if (dllHook != NULL) {
+		checkBaseline(name, dllns);
+		if (record != NULL)
+			fprintf(record, "%s %.2f\n", name, dllns);
+	}
+	free(stream);
+}
+
+/*
+Simulates the trace with all timeout configurations of the sweep.
+*/
+static void sweep(const char *name, const struct KeyTraceRecord *trace, int count) {
+	static const DWORD timeouts[] = { 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024 };
+	static const DWORD percentiles[] = { 0, 50, 90, 99 };
+	static struct Simulation sim;
+	struct Result result;
+	LARGE_INTEGER start, end;
+	if (count == 0) {
+		printf("%-20s no events\n", name);
+		return;
+	}
+	double span = (double)(trace[count - 1].Time - trace[0].Time);
+	for (int t = 0; t < sizeof timeouts / sizeof *timeouts; t++) {
+		for (int p = 0; p < sizeof percentiles / sizeof *percentiles; p++) {
+			struct KeyFilterAdaptive config = adaptive;
+			config.Percentile = percentiles[p];
+			startSimulation(&sim, timeouts[t], &config);
+			QueryPerformanceCounter(&start);
+			expand(trace, count, NULL, &sim, &result);
+			QueryPerformanceCounter(&end);
+			double ms = (end.QuadPart - start.QuadPart) * 1000.0 / frequency;
+			printf("%-20s %7lu %5lu %6d %6d %7d %8.1f %7lu %7lu %10.0f\n", name, timeouts[t], percentiles[p], result.Leaked, result.Lost,
+				result.Delayed, result.Delayed > 0 ? (double)result.DelaySum / result.Delayed : 0.0, result.DelayMax, sim.Current,
+				ms > 0 ? span / ms : 0.0);
+		}
+	}
+}
+
+/*
+Reads a rule file into rules with the parser of the hook.
+*/
+static BOOL loadRuleFile(const char *name) {
+	static BYTE buffer[8192];
+	FILE *file;
+	if (fopen_s(&file, name, "rb") != 0)
+		return FALSE;
+	DWORD size = (DWORD)fread(buffer, 1, sizeof buffer, file);
+	fclose(file);
+	return KeyFilterParseRules(&rules, buffer, size);
+}
+
+int main(int argc, char **argv) {
+	int rounds = 100, files = 0;
+	const char *ruleFile = NULL;
+	BOOL dll = FALSE, save = FALSE, simulate = FALSE;
+	LARGE_INTEGER freq;
+	QueryPerformanceFrequency(&freq);
+	frequency = (double)freq.QuadPart;
+	for (int i = 1; i < argc; i++) {
+		if (_strnicmp(argv[i], "/rounds:", 8) == 0 && atoi(argv[i] + 8) > 0)
+			rounds = atoi(argv[i] + 8);
+		else if (_strnicmp(argv[i], "/timeout:", 9) == 0 && atoi(argv[i] + 9) > 0)
+			timeout = atoi(argv[i] + 9);
+		else if (_strnicmp(argv[i], "/adaptive:", 10) == 0 && atoi(argv[i] + 10) > 0 && atoi(argv[i] + 10) <= 100)
+			adaptive.Percentile = atoi(argv[i] + 10);
+		else if (_strnicmp(argv[i], "/margin:", 8) == 0)
+			adaptive.Margin = atoi(argv[i] + 8);
+		else if (_strnicmp(argv[i], "/minimum:", 9) == 0)
+			adaptive.Minimum = atoi(argv[i] + 9);
+		else if (_strnicmp(argv[i], "/rules:", 7) == 0)
+			ruleFile = argv[i] + 7;
+		else if (_stricmp(argv[i], "/dll") == 0)
+			dll = TRUE;
+		else if (_strnicmp(argv[i], "/maxns:", 7) == 0 && atof(argv[i] + 7) > 0)
+			maxns = atof(argv[i] + 7), dll = TRUE;
+		else if (_strnicmp(argv[i], "/baseline:", 10) == 0) {
+			if (!loadBaseline(argv[i] + 10)) {
+				fprintf(stderr, "Cannot read baseline %s\n", argv[i] + 10);
+				return 1;
+			}
+			dll = TRUE;
+		}
+		else if (_strnicmp(argv[i], "/tolerance:", 11) == 0 && atof(argv[i] + 11) >= 0)
+			tolerance = atof(argv[i] + 11);
+		else if (_strnicmp(argv[i], "/record:", 8) == 0) {
+			if (fopen_s(&record, argv[i] + 8, "w") != 0) {
+				fprintf(stderr, "Cannot write baseline %s\n", argv[i] + 8);
+				return 1;
+			}
+			dll = TRUE;
+		}
+		else if (_stricmp(argv[i], "/sweep") == 0)
+			simulate = TRUE;
+		else if (_stricmp(argv[i], "/save") == 0)
+			save = TRUE;
+		else
+			files++;
+	}
+	static const BYTE touchpadKeys[] = { VK_TAB, VK_LCONTROL, VK_LEFT };
+	KeyFilterInitRules(&rules);
+	KeyFilterAddRule(&rules, 0x5b, 0x5b, 0, NULL, 0);
+	defaultRules = rules;
+	KeyFilterInitRules(&touchpadRules);
+	KeyFilterAddRule(&touchpadRules, 0x5b, 0x5b, 0, touchpadKeys, sizeof touchpadKeys);
+	if (ruleFile != NULL && !loadRuleFile(ruleFile)) {
+		fprintf(stderr, "Cannot load rule file %s\n", ruleFile);
+		return 1;
+	}
+	if (dll) {
+		// High resolution timer without waiting thread, timeouts are driven by the simulation (see runDll).
+		SetEnvironmentVariableA("NoEdgeTimer", "highres");
+		SetEnvironmentVariableA("NoEdgeDryRun", "1");
+		HINSTANCE hi = LoadLibraryA("NoEdgeShortcuts.dll");
+		GetNoEdgeFunctionsProc getFunctions = hi == NULL ? NULL : (GetNoEdgeFunctionsProc)GetProcAddress(hi, "GetNoEdgeFunctions");
+		const struct NoEdgeFunctions *functions = getFunctions == NULL ? NULL : getFunctions(NOEDGE_API_VERSION);
+		if (functions == NULL || functions->Size < sizeof *functions || !functions->Init() || (dllHook = functions->KeyboardHook) == NULL) {
+			fprintf(stderr, "Cannot load hook procedure from NoEdgeShortcuts.dll\n");
+			return 1;
+		}
+		dllTimeout = functions->HighResTimeout;
+		dllSetRules = functions->SetRules;
+		dllSetRules(&rules);
+	}
+	if (simulate)
+		printf("%-20s %7s %5s %6s %6s %7s %8s %7s %7s %10s\n", "trace", "timeout", "adapt", "leak", "lost", "delayed", "avg ms", "max ms",
+			"final", "x realtime");
+	else
+		printf("%-20s %8s %7s %7s %7s %7s %7s %7s %7s %7s %6s %6s %5s %5s %5s\n", "trace", "events", "core", "cycles", "fast", "cycles", "switch", "cycles",
+			"dll", "cycles", "replay", "swallw", "leak", "lost", "diff");
+	if (!simulate && !dll)
+		printf("(core, fast and switch: filter core in process only, /dll measures the hook procedure)\n");
+	if (files == 0) {
+		// chords runs with touchpadRules unless a rule file is given, see addChord.
+		static const struct { const char *Name; int Hotkeys, Edgeswipes, Repeats, Chords; DWORD Pace; } synthetic[] = {
+			{ "typing", 0, 0, 0, 0, 60 }, { "fasttyping", 0, 0, 0, 0, 20 }, { "autorepeat", 0, 0, 50, 0, 60 },
+			{ "hotkeys", 20, 0, 0, 0, 60 }, { "edgeswipes", 0, 20, 0, 0, 60 }, { "mixed", 10, 10, 5, 0, 60 },
+			{ "chords", 0, 10, 0, 20, 60 }
+		};
+		int count = 1 << 16;
+		struct KeyTraceRecord *events = (struct KeyTraceRecord*)malloc(count * sizeof *events);
+		if (events == NULL)
+			return 1;
+		for (int i = 0; i < sizeof synthetic / sizeof *synthetic; i++) {
+			srand(1);
+			generate(events, count, synthetic[i].Hotkeys, synthetic[i].Edgeswipes, synthetic[i].Repeats, synthetic[i].Chords, synthetic[i].Pace);
+			BOOL touchpad = synthetic[i].Chords > 0 && ruleFile == NULL;
+			if (touchpad)
+				useRules(&touchpadRules);
+			if (save)
+				saveTrace(synthetic[i].Name, events, count);
+			if (simulate)
+				sweep(synthetic[i].Name, events, count);
+			else
+				bench(synthetic[i].Name, events, count, rounds);
+			if (touchpad)
+				useRules(&defaultRules);
+		}
+		free(events);
+	}
+	else {
+		for (int i = 1; i < argc; i++) {
+			if (argv[i][0] != '/') {
+				struct KeyTraceRecord *events;
+				int count = loadTrace(argv[i], &events);
+				if (simulate)
+					sweep(argv[i], events, count);
+				else
+					bench(argv[i], events, count, rounds);
+				free(events);
+			}
+		}
+	}
+	if (!simulate) {
+		if (record != NULL)
+			fclose(record);
+		printf("lost claim check: %d races, %d trigger keys stuck, %d presses replayed twice\n", raceLost, raceStuck, raceDoubled);
+		if (raceStuck + raceDoubled > 0)
+			return 4;
+	}
+	return regressed ? 3 : 0;
+}